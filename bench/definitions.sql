@@ -42,3 +42,35 @@ create or replace function caller_cache(i int) returns int as $$
 	}
 	return this.func(i) + this.func(i * i);
 $$ language plv8;
+
+-- plv8.execute() result set conversion; run e.g.
+--   select 200000 * 10 / (plbench('select js_fetch_rows(200000)', 10) / 1000)
+-- to get rows/sec.
+create or replace function js_fetch_rows(n int) returns int as $$
+	var rows = plv8.execute(
+		"SELECT i, 'row ' || i AS t, i * 0.5 AS f, i % 2 = 0 AS b " +
+		"FROM generate_series(1, $1) AS s(i)", [n]);
+	return rows.length;
+$$ language plv8;
+
+-- per-row calls vs. one call over an array; compare e.g.
+--   select plbench('select sum(js_scale(i::float8, 2)) from generate_series(1, 100000) i', 10)
+--   select plbench('select sum(x) from unnest(js_scale_all(
+--                    (select array_agg(i::float8) from generate_series(1, 100000) i)::plv8_float8array, 2)) x', 10)
+create or replace function js_scale(x float8, k float8) returns float8 as $$
+	return x * k;
+$$ language plv8 immutable strict;
+
+create or replace function js_scale_all(ary plv8_float8array, k float8) returns float8[] as $$
+	var result = new Array(ary.length);
+	for (var i = 0; i < ary.length; i++)
+		result[i] = ary[i] * k;
+	return result;
+$$ language plv8 immutable strict;
+
+-- the same per-row function batched by plv8_map(), e.g.
+--   select plbench('select sum(x) from unnest(plv8_map(''js_double(float8)'',
+--                    (select array_agg(i::float8) from generate_series(1, 100000) i))) x', 10)
+create or replace function js_double(x float8) returns float8 as $$
+	return x * 2;
+$$ language plv8 immutable strict;
@@ -15,6 +15,7 @@ extern "C" {
 #define	typename	typename_
 #define	using		using_
 
+#include "access/hash.h"
 #if PG_VERSION_NUM >= 90300
 #include "access/htup_details.h"
 #endif
@@ -22,6 +23,7 @@ extern "C" {
 #include "catalog/pg_proc.h"
 #include "catalog/pg_type.h"
 #include "commands/trigger.h"
+#include "executor/executor.h"
 #include "executor/spi.h"
 #include "funcapi.h"
 #include "miscadmin.h"
@@ -68,9 +70,19 @@ Datum	plls_inline_handler(PG_FUNCTION_ARGS) throw();
 
 using namespace v8;
 
-typedef struct plv8_proc_cache
+/*
+ * The compiled function belongs to the global context of the user, so the
+ * cache is keyed by the user as well as the function.
+ */
+typedef struct plv8_proc_key
 {
 	Oid						fn_oid;
+	Oid						user_id;
+} plv8_proc_key;
+
+typedef struct plv8_proc_cache
+{
+	plv8_proc_key			key;		/* hash key (must be first) */
 
 	Persistent<Function>	function;
 	char					proname[NAMEDATALEN];
@@ -78,7 +90,9 @@ typedef struct plv8_proc_cache
 
 	TransactionId			fn_xmin;
 	ItemPointerData			fn_tid;
-	Oid						user_id;
+	uint32					xact_gen;	/* transaction last used in */
+	struct plv8_proc_cache *prev;		/* more recently used */
+	struct plv8_proc_cache *next;		/* less recently used */
 
 	int						nargs;
 	bool					retset;		/* true if SRF */
@@ -99,8 +113,8 @@ typedef struct plv8_exec_env
 } plv8_exec_env;
 
 /*
- * We cannot cache plv8_type inter executions because it has FmgrInfo fields.
- * So, we cache rettype and argtype in fn_extra only during one execution.
+ * rettype and argtypes are copied from the session-wide type cache into
+ * fn_extra, as their FmgrInfo fields belong to the memory context of it.
  */
 typedef struct plv8_proc
 {
@@ -111,6 +125,23 @@ typedef struct plv8_proc
 	plv8_type				argtypes[FUNC_MAX_ARGS];
 } plv8_proc;
 
+/*
+ * State of a SRF call in the value-per-call mode.  It lives across calls,
+ * so it's allocated in TopTransactionContext and linked to the list.  The
+ * ExprContext shutdown callback does not run if the query is aborted, so
+ * the states are also cleaned up at the abort of the subtransaction they
+ * were created in, and at the end of transaction.  conv is NULL for scalar.
+ */
+typedef struct plv8_srf_state
+{
+	FmgrInfo			   *flinfo;
+	ExprContext			   *econtext;
+	SubTransactionId		subid;		/* subtransaction that created it */
+	Persistent<Object>		iter;
+	Converter			   *conv;
+	struct plv8_srf_state  *next;
+} plv8_srf_state;
+
 /*
  * For the security reasons, the global context is separated
  * between users and it's associated with user id.
@@ -121,11 +152,77 @@ typedef struct plv8_context
 	Oid						user_id;
 } plv8_context;
 
+/*
+ * The entries are also linked in the order of use.  The ones used in the
+ * current transaction may be referenced by fn_extra, so only the older ones
+ * are evicted as new ones are added, and the rest at the end of transaction.
+ */
 static HTAB *plv8_proc_cache_hash = NULL;
+static plv8_proc_cache *plv8_proc_cache_head = NULL;	/* most recently used */
+static plv8_proc_cache *plv8_proc_cache_tail = NULL;	/* least recently used */
+static uint32 plv8_proc_xact_gen = 0;
+
+/*
+ * Column names and other fixed names given to JS are interned as symbols
+ * in this table, so that the converters and triggers share one string
+ * instead of allocating it each time.  Entries are never removed, so the
+ * number of entries is capped.
+ */
+#define PLV8_MAX_INTERNED_NAMES		10000
+
+typedef struct plv8_name_entry
+{
+	NameData				name;		/* hash key */
+	Persistent<String>		symbol;
+} plv8_name_entry;
+
+static HTAB *plv8_name_hash = NULL;
+
+/*
+ * Converters of the composite types and the trigger relations are cached
+ * in the session, keyed by the type of the tuple descriptor.  Each entry
+ * has its own copy of the descriptor, which is compared with the current
+ * one on lookup, so that ALTER TABLE or ALTER TYPE rebuilds the entry.
+ */
+#define PLV8_MAX_CACHED_CONVERTERS	256
+
+typedef struct plv8_converter_key
+{
+	Oid			typid;
+	int32		typmod;
+} plv8_converter_key;
+
+typedef struct plv8_converter_cache
+{
+	plv8_converter_key	key;		/* hash key */
+	TupleDesc			tupdesc;
+	Converter		   *conv;
+} plv8_converter_cache;
+
+static HTAB *plv8_converter_hash = NULL;
+static MemoryContext plv8_converter_context = NULL;
 
 static plv8_exec_env		   *exec_env_head = NULL;
 
+static plv8_srf_state		   *srf_state_head = NULL;
+
+/*
+ * The SPI frames of running invocations, innermost last.  They are kept
+ * off the C stack so that the entries of the frames skipped by longjmp can
+ * be dropped when their subtransaction aborts.
+ */
+typedef struct plv8_spi_frame
+{
+	SubTransactionId	subid;		/* subtransaction that started the frame */
+	bool				connected;
+} plv8_spi_frame;
+
+static std::vector<plv8_spi_frame>	spi_frames;
+
 extern const unsigned char coffee_script_binary_data[];
+#ifdef PLV8_STARTUP_JS
+extern const unsigned char startup_js_binary_data[];
+#endif
 extern const unsigned char livescript_binary_data[];
 
 /*
@@ -135,6 +232,14 @@ extern const unsigned char livescript_binary_data[];
 static plv8_proc *plv8_get_proc(Oid fn_oid, FunctionCallInfo fcinfo,
 		bool validate, char ***argnames) throw();
 static void plv8_xact_cb(XactEvent event, void *arg);
+static void plv8_subxact_cb(SubXactEvent event, SubTransactionId mySubid,
+		SubTransactionId parentSubid, void *arg);
+static void plv8_evict_procs(void);
+static void plv8_evict_converters(void);
+static bool plv8_tupdesc_matches(TupleDesc cached, TupleDesc tupdesc);
+static plv8_srf_state *plv8_find_srf_state(FunctionCallInfo fcinfo);
+static void plv8_free_srf_state(plv8_srf_state *srf);
+static void plv8_srf_shutdown(Datum arg);
 
 /*
  * CamelCaseFunctions are C++ functions.
@@ -145,11 +250,15 @@ static plv8_proc *Compile(Oid fn_oid, FunctionCallInfo fcinfo,
 					bool validate, bool is_trigger, Dialect dialect);
 static Local<Function> CompileFunction(const char *proname, int proarglen,
 					const char *proargs[], const char *prosrc,
-					bool is_trigger, bool retset, Dialect dialect);
+					bool is_trigger, bool retset, Dialect dialect,
+					Oid fn_oid = InvalidOid,
+					TransactionId fn_xmin = InvalidTransactionId);
 static Datum CallFunction(PG_FUNCTION_ARGS, plv8_exec_env *xenv,
 		int nargs, plv8_type argtypes[], plv8_type *rettype);
 static Datum CallSRFunction(PG_FUNCTION_ARGS, plv8_exec_env *xenv,
 		int nargs, plv8_type argtypes[], plv8_type *rettype);
+static Datum CallSRFunctionNext(PG_FUNCTION_ARGS, plv8_exec_env *xenv,
+	plv8_srf_state *srf, plv8_type *rettype);
 static Datum CallTrigger(PG_FUNCTION_ARGS, plv8_exec_env *xenv);
 static Persistent<Context> GetGlobalContext();
 static Persistent<ObjectTemplate> GetGlobalObjectTemplate();
@@ -157,8 +266,14 @@ static Persistent<ObjectTemplate> GetGlobalObjectTemplate();
 /* A GUC to specify a custom start up function to call */
 static char *plv8_start_proc = NULL;
 
+/* A GUC to enable the built-in startup script */
+static bool plv8_startup_js = true;
+
 /* A GUC to specify the remote debugger port */
 static int plv8_debugger_port;
+
+/* A GUC to specify the max number of compiled functions to keep */
+static int plv8_proc_cache_size;
 /*
  * We use vector instead of hash since the size of this array
  * is expected to be short in most cases.
@@ -191,12 +306,30 @@ _PG_init(void)
 {
 	HASHCTL    hash_ctl = { 0 };
 	
-	hash_ctl.keysize = sizeof(Oid);
+	hash_ctl.keysize = sizeof(plv8_proc_key);
 	hash_ctl.entrysize = sizeof(plv8_proc_cache);
-	hash_ctl.hash = oid_hash;
+	hash_ctl.hash = tag_hash;
 	plv8_proc_cache_hash = hash_create("PLv8 Procedures", 32,
 									   &hash_ctl, HASH_ELEM | HASH_FUNCTION);
 
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = NAMEDATALEN;
+	hash_ctl.entrysize = sizeof(plv8_name_entry);
+	plv8_name_hash = hash_create("PLv8 Interned Names", 256,
+								 &hash_ctl, HASH_ELEM);
+
+	plv8_converter_context = AllocSetContextCreate(TopMemoryContext,
+									"PLv8 Converters",
+									ALLOCSET_SMALL_MINSIZE,
+									ALLOCSET_SMALL_INITSIZE,
+									ALLOCSET_DEFAULT_MAXSIZE);
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(plv8_converter_key);
+	hash_ctl.entrysize = sizeof(plv8_converter_cache);
+	hash_ctl.hash = tag_hash;
+	plv8_converter_hash = hash_create("PLv8 Converters", 32,
+									  &hash_ctl, HASH_ELEM | HASH_FUNCTION);
+
 	DefineCustomStringVariable("plv8.start_proc",
 							   gettext_noop("PLV8 function to run once when PLV8 is first used."),
 							   NULL,
@@ -222,7 +355,89 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomIntVariable("plv8.proc_cache_size",
+							gettext_noop("Maximum number of compiled functions kept in a session."),
+							gettext_noop("Functions are cached per user, and the least recently "
+										 "used ones are evicted as new ones are compiled, or at the "
+										 "end of transaction if used in it."),
+							&plv8_proc_cache_size,
+							1000, 1, INT_MAX,
+							PGC_USERSET, 0,
+#if PG_VERSION_NUM >= 90100
+							NULL,
+#endif
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("plv8.plan_cache_size",
+							gettext_noop("Maximum number of plans of plv8.execute() kept in a session."),
+							gettext_noop("The plans of statements with parameters are reused, and "
+										 "the least recently used ones that are not running are "
+										 "evicted as new ones are added.  0 disables the cache."),
+							&plv8_plan_cache_size,
+							100, 0, INT_MAX,
+							PGC_USERSET, 0,
+#if PG_VERSION_NUM >= 90100
+							NULL,
+#endif
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("plv8.external_string_threshold",
+							gettext_noop("Minimum size of text given to JS without copying it to the JS heap."),
+							gettext_noop("Text of this size or larger in ASCII is kept outside "
+										 "of the JS heap.  -1 disables this."),
+							&plv8_external_string_threshold,
+							1024, -1, INT_MAX,
+							PGC_USERSET, GUC_UNIT_KB,
+#if PG_VERSION_NUM >= 90100
+							NULL,
+#endif
+							NULL,
+							NULL);
+
+#ifdef PLV8_STARTUP_JS
+	DefineCustomBoolVariable("plv8.startup_js",
+							 gettext_noop("Runs the built-in startup script in new global contexts."),
+							 NULL,
+							 &plv8_startup_js,
+							 true,
+							 PGC_USERSET, 0,
+#if PG_VERSION_NUM >= 90100
+							 NULL,
+#endif
+							 NULL,
+							 NULL);
+#endif
+
+	DefineCustomBoolVariable("plv8.code_cache",
+							 gettext_noop("Stores the parser data of functions on disk."),
+							 gettext_noop("The data is kept in plv8_cache directory under "
+										  "the data directory, and shared by the sessions."),
+							 &plv8_code_cache,
+							 false,
+							 PGC_SUSET, 0,
+#if PG_VERSION_NUM >= 90100
+							 NULL,
+#endif
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("plv8.numeric_as_string",
+							 gettext_noop("Converts numeric values to JS strings instead of numbers."),
+							 gettext_noop("The strings keep all the digits, which may be lost "
+										  "in the conversion to numbers."),
+							 &plv8_numeric_as_string,
+							 false,
+							 PGC_USERSET, 0,
+#if PG_VERSION_NUM >= 90100
+							 NULL,
+#endif
+							 NULL,
+							 NULL);
+
 	RegisterXactCallback(plv8_xact_cb, NULL);
+	RegisterSubXactCallback(plv8_subxact_cb, NULL);
 
 	EmitWarningsOnPlaceholders("plv8");
 }
@@ -246,6 +461,202 @@ plv8_xact_cb(XactEvent event, void *arg)
 		 */
 	}
 	exec_env_head = NULL;
+
+	while (srf_state_head)
+		plv8_free_srf_state(srf_state_head);
+
+	/* In case the frames were not unwound properly on error. */
+	spi_frames.clear();
+
+	plv8_release_lazy_rows();
+	plv8_evict_procs();
+	plv8_evict_converters();
+	plv8_evict_plans();
+}
+
+static void
+plv8_subxact_cb(SubXactEvent event, SubTransactionId mySubid,
+				SubTransactionId parentSubid, void *arg)
+{
+	plv8_srf_state	   *srf = srf_state_head;
+
+	while (srf)
+	{
+		plv8_srf_state	   *next = srf->next;
+
+		if (srf->subid == mySubid)
+		{
+			/* The query of the state is gone with the subtransaction. */
+			if (event == SUBXACT_EVENT_ABORT_SUB)
+				plv8_free_srf_state(srf);
+			else if (event == SUBXACT_EVENT_COMMIT_SUB)
+				srf->subid = parentSubid;
+		}
+		srf = next;
+	}
+
+	/*
+	 * The frames started in the aborted subtransaction were skipped by
+	 * longjmp.  Their connections have been closed by SPI itself.
+	 */
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+	{
+		while (!spi_frames.empty() && spi_frames.back().subid >= mySubid)
+			spi_frames.pop_back();
+	}
+}
+
+static void
+plv8_unlink_proc(plv8_proc_cache *cache)
+{
+	if (cache->prev)
+		cache->prev->next = cache->next;
+	else
+		plv8_proc_cache_head = cache->next;
+	if (cache->next)
+		cache->next->prev = cache->prev;
+	else
+		plv8_proc_cache_tail = cache->prev;
+	cache->prev = cache->next = NULL;
+}
+
+static void
+plv8_link_proc(plv8_proc_cache *cache)
+{
+	cache->prev = NULL;
+	cache->next = plv8_proc_cache_head;
+	if (plv8_proc_cache_head)
+		plv8_proc_cache_head->prev = cache;
+	else
+		plv8_proc_cache_tail = cache;
+	plv8_proc_cache_head = cache;
+}
+
+/*
+ * Evict the least recently used functions beyond plv8.proc_cache_size,
+ * except for the ones used in the current transaction.
+ */
+static void
+plv8_trim_procs(void)
+{
+	long	nevict = hash_get_num_entries(plv8_proc_cache_hash) -
+					 plv8_proc_cache_size;
+
+	while (nevict-- > 0 && plv8_proc_cache_tail != NULL &&
+		   plv8_proc_cache_tail->xact_gen != plv8_proc_xact_gen)
+	{
+		plv8_proc_cache	   *oldest = plv8_proc_cache_tail;
+
+		plv8_unlink_proc(oldest);
+		if (oldest->prosrc)
+			pfree(oldest->prosrc);
+		oldest->function.Dispose();
+		oldest->function.Clear();
+		hash_search(plv8_proc_cache_hash, &oldest->key, HASH_REMOVE, NULL);
+	}
+}
+
+/*
+ * Called at the end of transaction, when no function is running.  The
+ * functions used in the transaction become evictable.
+ */
+static void
+plv8_evict_procs(void)
+{
+	plv8_proc_xact_gen++;
+	plv8_trim_procs();
+}
+
+/*
+ * Forget all the cached converters if there are too many.  A converter may
+ * be in use while the functions are running, so this is done only at the
+ * end of transaction.
+ */
+static void
+plv8_evict_converters(void)
+{
+	HASH_SEQ_STATUS			status;
+	plv8_converter_cache   *cache;
+
+	if (hash_get_num_entries(plv8_converter_hash) <= PLV8_MAX_CACHED_CONVERTERS)
+		return;
+
+	hash_seq_init(&status, plv8_converter_hash);
+	while ((cache = (plv8_converter_cache *) hash_seq_search(&status)) != NULL)
+	{
+		delete cache->conv;
+		FreeTupleDesc(cache->tupdesc);
+		hash_search(plv8_converter_hash, &cache->key, HASH_REMOVE, NULL);
+	}
+}
+
+/*
+ * Returns true if the converter built for the cached descriptor works for
+ * the other.  Only what the converter looks at is compared.
+ */
+static bool
+plv8_tupdesc_matches(TupleDesc cached, TupleDesc tupdesc)
+{
+	if (cached->natts != tupdesc->natts)
+		return false;
+
+	for (int c = 0; c < cached->natts; c++)
+	{
+		Form_pg_attribute	attr1 = cached->attrs[c];
+		Form_pg_attribute	attr2 = tupdesc->attrs[c];
+
+		if (attr1->atttypid != attr2->atttypid ||
+			attr1->attisdropped != attr2->attisdropped ||
+			strcmp(NameStr(attr1->attname), NameStr(attr2->attname)) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Returns the value-per-call state if this SRF call is in progress.
+ */
+static plv8_srf_state *
+plv8_find_srf_state(FunctionCallInfo fcinfo)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		return NULL;
+
+	for (plv8_srf_state *srf = srf_state_head; srf; srf = srf->next)
+	{
+		if (srf->flinfo == fcinfo->flinfo && srf->econtext == rsinfo->econtext)
+			return srf;
+	}
+
+	return NULL;
+}
+
+static void
+plv8_free_srf_state(plv8_srf_state *srf)
+{
+	plv8_srf_state	  **prev = &srf_state_head;
+
+	while (*prev != srf)
+		prev = &(*prev)->next;
+	*prev = srf->next;
+
+	srf->iter.Dispose();
+	srf->iter.Clear();
+	delete srf->conv;
+	pfree(srf);
+}
+
+/*
+ * Called when the executor stops reading the SRF, e.g. by LIMIT, or
+ * rescans it.
+ */
+static void
+plv8_srf_shutdown(Datum arg)
+{
+	plv8_free_srf_state((plv8_srf_state *) DatumGetPointer(arg));
 }
 
 static inline plv8_exec_env *
@@ -293,8 +704,15 @@ common_pl_call_handler(PG_FUNCTION_ARGS, Dialect dialect) throw()
 		if (is_trigger)
 			return CallTrigger(fcinfo, proc->xenv);
 		else if (cache->retset)
+		{
+			plv8_srf_state *srf = plv8_find_srf_state(fcinfo);
+
+			if (srf)
+				return CallSRFunctionNext(fcinfo, proc->xenv,
+						srf, &proc->rettype);
 			return CallSRFunction(fcinfo, proc->xenv,
 						cache->nargs, proc->argtypes, &proc->rettype);
+		}
 		else
 			return CallFunction(fcinfo, proc->xenv,
 						cache->nargs, proc->argtypes, &proc->rettype);
@@ -369,6 +787,66 @@ plls_inline_handler(PG_FUNCTION_ARGS) throw()
 }
 #endif
 
+/*
+ * SPIFrame -- A JS invocation that may connect to SPI.
+ *
+ * Connecting to SPI costs a couple of memory contexts, which is not small
+ * for simple functions called per row.  So the connection is made only
+ * when a SPI function is used first in the invocation, via
+ * EnsureSPIConnected().  The frames are stacked as the invocations nest.
+ */
+class SPIFrame
+{
+private:
+	size_t		m_depth;
+
+	/* false if the entry was dropped by a subtransaction abort */
+	bool Alive()
+	{
+		return m_depth < spi_frames.size();
+	}
+
+public:
+	SPIFrame() : m_depth(spi_frames.size())
+	{
+		plv8_spi_frame	frame = { GetCurrentSubTransactionId(), false };
+
+		spi_frames.push_back(frame);
+	}
+	~SPIFrame()
+	{
+		/* Still connected only if we are unwinding by an exception. */
+		if (Alive() && spi_frames[m_depth].connected)
+			SPI_finish();
+		/* This also drops the inner frames skipped by longjmp, if any. */
+		if (Alive())
+			spi_frames.resize(m_depth);
+	}
+	int Finish()
+	{
+		if (!Alive() || !spi_frames[m_depth].connected)
+			return SPI_OK_FINISH;
+		spi_frames[m_depth].connected = false;
+		return SPI_finish();
+	}
+};
+
+void
+EnsureSPIConnected()
+{
+	if (spi_frames.empty())
+		throw js_error("SPI is not available out of function call");
+
+	plv8_spi_frame	   &frame = spi_frames.back();
+
+	if (!frame.connected)
+	{
+		if (SPI_connect() != SPI_OK_CONNECT)
+			throw js_error("could not connect to SPI manager");
+		frame.connected = true;
+	}
+}
+
 /*
  * DoCall -- Call a JS function with SPI support.
  *
@@ -379,11 +857,10 @@ DoCall(Handle<Function> fn, Handle<Object> receiver,
 	int nargs, Handle<v8::Value> args[])
 {
 	TryCatch		try_catch;
+	SPIFrame		frame;
 
-	if (SPI_connect() != SPI_OK_CONNECT)
-		throw js_error("could not connect to SPI manager");
 	Local<v8::Value> result = fn->Call(receiver, nargs, args);
-	int	status = SPI_finish();
+	int	status = frame.Finish();
 
 	if (result.IsEmpty())
 		throw js_error(try_catch);
@@ -394,6 +871,73 @@ DoCall(Handle<Function> fn, Handle<Object> receiver,
 	return result;
 }
 
+/*
+ * An iterator is an object that has next() method, which returns
+ * { done: bool, value: any } for each call.
+ */
+static bool
+IsIterator(Handle<v8::Value> value)
+{
+	if (!value->IsObject() || value->IsArray())
+		return false;
+
+	Handle<Object>	obj = Handle<Object>::Cast(value);
+	return obj->Get(String::NewSymbol("next"))->IsFunction();
+}
+
+/*
+ * IteratorNext -- Call next() of the iterator.
+ *
+ * Returns false if the iterator is done, or stores the value otherwise.
+ * The caller must connect to SPI, as the iterator may issue SQL commands.
+ */
+static bool
+IteratorNext(Handle<Object> iter, Local<v8::Value> *value)
+{
+	TryCatch			try_catch;
+	Local<Function>		next =
+		Local<Function>::Cast(iter->Get(String::NewSymbol("next")));
+	Local<v8::Value>	item = next->Call(iter, 0, NULL);
+
+	if (item.IsEmpty())
+		throw js_error(try_catch);
+	if (!item->IsObject())
+		throw js_error("iterator result must be an object");
+
+	Local<Object>	obj = Local<Object>::Cast(item);
+	if (obj->Get(String::NewSymbol("done"))->BooleanValue())
+		return false;
+
+	*value = obj->Get(String::NewSymbol("value"));
+	return true;
+}
+
+/*
+ * DrainIterator -- Store the values from the iterator into the tuplestore.
+ *
+ * The values are generated and stored one by one, so we don't need to keep
+ * the whole result in the JS heap.
+ */
+static void
+DrainIterator(Handle<Object> iter, Converter *conv, Tuplestorestate *tupstore)
+{
+	SPIFrame	frame;
+
+	for (;;)
+	{
+		HandleScope			handle_scope;
+		Local<v8::Value>	value;
+
+		if (!IteratorNext(iter, &value))
+			break;
+		conv->ToDatum(value, tupstore);
+	}
+
+	int	status = frame.Finish();
+	if (status < 0)
+		throw js_error(FormatSPIStatus(status));
+}
+
 static Datum
 CallFunction(PG_FUNCTION_ARGS, plv8_exec_env *xenv,
 	int nargs, plv8_type argtypes[], plv8_type *rettype)
@@ -496,6 +1040,107 @@ CreateTupleStore(PG_FUNCTION_ARGS, TupleDesc *tupdesc)
 	return tupstore;
 }
 
+/*
+ * Switch to the value-per-call mode, discarding the empty tuplestore, and
+ * return the first value.  The iterator is kept in plv8_srf_state and the
+ * following calls go to CallSRFunctionNext.
+ */
+static Datum
+BeginValuePerCall(PG_FUNCTION_ARGS, plv8_exec_env *xenv, Handle<Object> iter,
+	TupleDesc tupdesc, Tuplestorestate *tupstore, plv8_type *rettype)
+{
+	plv8_proc		   *proc = (plv8_proc *) fcinfo->flinfo->fn_extra;
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	plv8_srf_state	   *srf;
+
+	PG_TRY();
+	{
+		tuplestore_end(tupstore);
+		rsinfo->returnMode = SFRM_ValuePerCall;
+		rsinfo->setResult = NULL;
+		/* Records are returned as datum, which needs the type id. */
+		if (proc->functypclass != TYPEFUNC_SCALAR)
+			BlessTupleDesc(tupdesc);
+
+		srf = (plv8_srf_state *)
+			MemoryContextAllocZero(TopTransactionContext,
+								   sizeof(plv8_srf_state));
+		RegisterExprContextCallback(rsinfo->econtext,
+									plv8_srf_shutdown, PointerGetDatum(srf));
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	new(&srf->iter) Persistent<Object>(Persistent<Object>::New(iter));
+	srf->flinfo = fcinfo->flinfo;
+	srf->econtext = rsinfo->econtext;
+	srf->subid = GetCurrentSubTransactionId();
+	srf->next = srf_state_head;
+	srf_state_head = srf;
+
+	if (proc->functypclass != TYPEFUNC_SCALAR)
+	{
+		MemoryContext	oldcontext =
+			MemoryContextSwitchTo(TopTransactionContext);
+
+		try
+		{
+			srf->conv = new Converter(tupdesc);
+		}
+		catch (...)
+		{
+			MemoryContextSwitchTo(oldcontext);
+			throw;
+		}
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	return CallSRFunctionNext(fcinfo, xenv, srf, rettype);
+}
+
+/*
+ * Return the next value of the SRF in the value-per-call mode.
+ */
+static Datum
+CallSRFunctionNext(PG_FUNCTION_ARGS, plv8_exec_env *xenv,
+	plv8_srf_state *srf, plv8_type *rettype)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Handle<Context>		context = xenv->context;
+	Context::Scope		context_scope(context);
+	Local<v8::Value>	value;
+	bool				found;
+
+	{
+		SPIFrame	frame;
+
+		found = IteratorNext(srf->iter, &value);
+
+		int	status = frame.Finish();
+		if (status < 0)
+			throw js_error(FormatSPIStatus(status));
+	}
+
+	if (!found)
+	{
+		UnregisterExprContextCallback(rsinfo->econtext,
+									  plv8_srf_shutdown, PointerGetDatum(srf));
+		plv8_free_srf_state(srf);
+		rsinfo->isDone = ExprEndResult;
+		fcinfo->isnull = true;
+		return (Datum) 0;
+	}
+
+	rsinfo->isDone = ExprMultipleResult;
+	if (srf->conv == NULL)
+		return ToDatum(value, &fcinfo->isnull, rettype);
+	else
+		return srf->conv->ToDatum(value);
+}
+
 static Datum
 CallSRFunction(PG_FUNCTION_ARGS, plv8_exec_env *xenv,
 	int nargs, plv8_type argtypes[], plv8_type *rettype)
@@ -535,7 +1180,22 @@ CallSRFunction(PG_FUNCTION_ARGS, plv8_exec_env *xenv,
 		// return an array of records.
 		int	length = array->Length();
 		for (int i = 0; i < length; i++)
+		{
+			HandleScope		handle_scope;
+
 			conv.ToDatum(array->Get(i), tupstore);
+		}
+	}
+	else if (IsIterator(result))
+	{
+		ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+		// return an iterator of records, one by one if the caller allows.
+		if (conv.StoredCount() == 0 &&
+			(rsinfo->allowedModes & SFRM_ValuePerCall))
+			return BeginValuePerCall(fcinfo, xenv,
+						Handle<Object>::Cast(result), tupdesc, tupstore, rettype);
+		DrainIterator(Handle<Object>::Cast(result), &conv, tupstore);
 	}
 	else
 	{
@@ -574,14 +1234,13 @@ CallTrigger(PG_FUNCTION_ARGS, plv8_exec_env *xenv)
 
 	if (TRIGGER_FIRED_FOR_ROW(event))
 	{
-		TupleDesc		tupdesc = RelationGetDescr(rel);
-		Converter		conv(tupdesc);
+		Converter	   *conv = LookupConverter(RelationGetDescr(rel));
 
 		if (TRIGGER_FIRED_BY_INSERT(event))
 		{
 			result = PointerGetDatum(trig->tg_trigtuple);
 			// NEW
-			args[0] = conv.ToValue(trig->tg_trigtuple);
+			args[0] = conv->ToValue(trig->tg_trigtuple);
 			// OLD
 			args[1] = Undefined();
 		}
@@ -591,15 +1250,15 @@ CallTrigger(PG_FUNCTION_ARGS, plv8_exec_env *xenv)
 			// NEW
 			args[0] = Undefined();
 			// OLD
-			args[1] = conv.ToValue(trig->tg_trigtuple);
+			args[1] = conv->ToValue(trig->tg_trigtuple);
 		}
 		else if (TRIGGER_FIRED_BY_UPDATE(event))
 		{
 			result = PointerGetDatum(trig->tg_newtuple);
 			// NEW
-			args[0] = conv.ToValue(trig->tg_newtuple);
+			args[0] = conv->ToValue(trig->tg_newtuple);
 			// OLD
-			args[1] = conv.ToValue(trig->tg_trigtuple);
+			args[1] = conv->ToValue(trig->tg_trigtuple);
 		}
 	}
 	else
@@ -612,29 +1271,29 @@ CallTrigger(PG_FUNCTION_ARGS, plv8_exec_env *xenv)
 
 	// 3: TG_WHEN
 	if (TRIGGER_FIRED_BEFORE(event))
-		args[3] = String::New("BEFORE");
+		args[3] = InternName("BEFORE");
 	else
-		args[3] = String::New("AFTER");
+		args[3] = InternName("AFTER");
 
 	// 4: TG_LEVEL
 	if (TRIGGER_FIRED_FOR_ROW(event))
-		args[4] = String::New("ROW");
+		args[4] = InternName("ROW");
 	else
-		args[4] = String::New("STATEMENT");
+		args[4] = InternName("STATEMENT");
 
 	// 5: TG_OP
 	if (TRIGGER_FIRED_BY_INSERT(event))
-		args[5] = String::New("INSERT");
+		args[5] = InternName("INSERT");
 	else if (TRIGGER_FIRED_BY_DELETE(event))
-		args[5] = String::New("DELETE");
+		args[5] = InternName("DELETE");
 	else if (TRIGGER_FIRED_BY_UPDATE(event))
-		args[5] = String::New("UPDATE");
+		args[5] = InternName("UPDATE");
 #ifdef TRIGGER_FIRED_BY_TRUNCATE
 	else if (TRIGGER_FIRED_BY_TRUNCATE(event))
-		args[5] = String::New("TRUNCATE");
+		args[5] = InternName("TRUNCATE");
 #endif
 	else
-		args[5] = String::New("?");
+		args[5] = InternName("?");
 
 	// 6: TG_RELID
 	args[6] = Uint32::New(RelationGetRelid(rel));
@@ -671,11 +1330,11 @@ CallTrigger(PG_FUNCTION_ARGS, plv8_exec_env *xenv)
 	}
 	else if (!newtup->IsUndefined())
 	{
-		TupleDesc		tupdesc = RelationGetDescr(rel);
-		Converter		conv(tupdesc);
+		/* Look up again; the entry may have been rebuilt while the function ran. */
+		Converter	   *conv = LookupConverter(RelationGetDescr(rel));
 		HeapTupleHeader	header;
 
-		header = DatumGetHeapTupleHeader(conv.ToDatum(newtup));
+		header = DatumGetHeapTupleHeader(conv->ToDatum(newtup));
 
 		/* We know it's there; heap_form_tuple stores with this layout. */
 		result = PointerGetDatum((char *) header - HEAPTUPLESIZE);
@@ -768,28 +1427,33 @@ plv8_get_proc(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, char ***argnam
 	Oid				   *argtypes;
 	char			   *argmodes;
 	MemoryContext		oldcontext;
+	plv8_proc_key		key;
 
 	procTup = SearchSysCache(PROCOID, ObjectIdGetDatum(fn_oid), 0, 0, 0);
 	if (!HeapTupleIsValid(procTup))
 		elog(ERROR, "cache lookup failed for function %u", fn_oid);
 
+	/*
+	 * The V8 function is associated with the context where it was
+	 * generated, which is per user, so we look up by the current user.
+	 */
+	MemSet(&key, 0, sizeof(key));
+	key.fn_oid = fn_oid;
+	key.user_id = GetUserId();
 	cache = (plv8_proc_cache *)
-		hash_search(plv8_proc_cache_hash,&fn_oid, HASH_ENTER, &found);
+		hash_search(plv8_proc_cache_hash, &key, HASH_ENTER, &found);
+	cache->xact_gen = plv8_proc_xact_gen;
 
 	if (found)
 	{
+		plv8_unlink_proc(cache);
+		plv8_link_proc(cache);
+
 		bool	uptodate;
 
-		/*
-		 * We need to check user id and dispose it if it's different from
-		 * the previous cache user id, as the V8 function is associated
-		 * with the context where it was generated.  In most cases,
-		 * we can expect this doesn't affect runtime performance.
-		 */
 		uptodate = (!cache->function.IsEmpty() &&
 			cache->fn_xmin == HeapTupleHeaderGetXmin(procTup->t_data) &&
-			ItemPointerEquals(&cache->fn_tid, &procTup->t_self) &&
-			cache->user_id == GetUserId());
+			ItemPointerEquals(&cache->fn_tid, &procTup->t_self));
 
 		if (!uptodate)
 		{
@@ -810,6 +1474,8 @@ plv8_get_proc(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, char ***argnam
 	{
 		new(&cache->function) Persistent<Function>();
 		cache->prosrc = NULL;
+		plv8_link_proc(cache);
+		plv8_trim_procs();
 	}
 
 	if (cache->function.IsEmpty())
@@ -828,7 +1494,6 @@ plv8_get_proc(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, char ***argnam
 		strlcpy(cache->proname, NameStr(procStruct->proname), NAMEDATALEN);
 		cache->fn_xmin = HeapTupleHeaderGetXmin(procTup->t_data);
 		cache->fn_tid = procTup->t_self;
-		cache->user_id = GetUserId();
 
 		int nargs = get_func_arg_info(procTup, &argtypes, argnames, &argmodes);
 
@@ -944,12 +1609,13 @@ static char *
 CompileDialect(const char *src, Dialect dialect)
 {
 	HandleScope		handle_scope;
-	static Persistent<Context>	context = Context::New(NULL);
-	Context::Scope	context_scope(context);
+	static Persistent<Context>	context;
+	static uint32	compiler_hash[PLV8_DIALECT_LIVESCRIPT + 1];
 	TryCatch		try_catch;
 	Local<String>	key;
 	char		   *cresult;
 	const char	   *dialect_binary_data;
+	char			kind[NAMEDATALEN];
 
 	switch (dialect)
 	{
@@ -969,6 +1635,52 @@ CompileDialect(const char *src, Dialect dialect)
 			throw js_error("Unknown Dialect");
 	}
 
+	/*
+	 * The output is cached by the source and the compiler version, so that
+	 * we don't need to boot the compiler for already compiled sources.
+	 */
+	if (plv8_code_cache)
+	{
+		PG_TRY();
+		{
+			int		len;
+			char   *data;
+
+			if (compiler_hash[dialect] == 0)
+				compiler_hash[dialect] = DatumGetUInt32(hash_any(
+						(const unsigned char *) dialect_binary_data,
+						strlen(dialect_binary_data)));
+			/* The encoding matters as the source is in the database's. */
+			snprintf(kind, sizeof(kind), "dialect%d_%d_%08x",
+					 (int) dialect, GetDatabaseEncoding(),
+					 compiler_hash[dialect]);
+
+			data = plv8_cache_lookup(kind, InvalidOid, InvalidTransactionId,
+									 src, strlen(src), &len);
+			if (data)
+			{
+				cresult = (char *) MemoryContextAlloc(TopMemoryContext, len + 1);
+				memcpy(cresult, data, len);
+				cresult[len] = '\0';
+				pfree(data);
+			}
+			else
+				cresult = NULL;
+		}
+		PG_CATCH();
+		{
+			throw pg_error();
+		}
+		PG_END_TRY();
+
+		if (cresult)
+			return cresult;
+	}
+
+	if (context.IsEmpty())
+		context = Context::New(NULL);
+	Context::Scope	context_scope(context);
+
 	if (context->Global()->Get(key)->IsUndefined())
 	{
 		HandleScope		handle_scope;
@@ -999,6 +1711,10 @@ CompileDialect(const char *src, Dialect dialect)
 		MemoryContext	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
 		cresult = pstrdup(result.str());
 		MemoryContextSwitchTo(oldcontext);
+
+		if (plv8_code_cache)
+			plv8_cache_store(kind, InvalidOid, InvalidTransactionId,
+							 src, strlen(src), cresult, strlen(cresult));
 	}
 	PG_CATCH();
 	{
@@ -1041,11 +1757,65 @@ Compile(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, bool is_trigger,
 						cache->prosrc,
 						is_trigger,
 						cache->retset,
-						dialect));
+						dialect,
+						fn_oid,
+						cache->fn_xmin));
 
 	return proc;
 }
 
+/*
+ * Returns the preparse data of the source from the code cache, or creates
+ * and stores it if not found.  This version of V8 cannot serialize the
+ * compiled code itself, but the preparse data lets the parser skip the
+ * inner functions until they are called.  If the data comes from the cache,
+ * the buffer is returned in *cached, which must live as long as the result.
+ */
+static ScriptData *
+GetScriptData(Oid fn_oid, TransactionId fn_xmin, const char *src, int len,
+			  Handle<String> source, char **cached)
+{
+	ScriptData *result;
+	int			datalen;
+
+	PG_TRY();
+	{
+		*cached = plv8_cache_lookup("script", fn_oid, fn_xmin,
+									src, len, &datalen);
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	/* V8 checks the sanity of the data, and ignores broken one. */
+	if (*cached)
+		return ScriptData::New(*cached, datalen);
+
+	result = ScriptData::PreCompile(source);
+	if (result->HasError())
+	{
+		/* Let the compiler report the syntax error. */
+		delete result;
+		return NULL;
+	}
+
+	PG_TRY();
+	{
+		plv8_cache_store("script", fn_oid, fn_xmin, src, len,
+						 result->Data(), result->Length());
+	}
+	PG_CATCH();
+	{
+		delete result;
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	return result;
+}
+
 static Local<Function>
 CompileFunction(
 	const char *proname,
@@ -1054,7 +1824,9 @@ CompileFunction(
 	const char *prosrc,
 	bool is_trigger,
 	bool retset,
-	Dialect dialect)
+	Dialect dialect,
+	Oid fn_oid,
+	TransactionId fn_xmin)
 {
 	HandleScope		handle_scope;
 	StringInfoData	src;
@@ -1102,11 +1874,23 @@ CompileFunction(
 	else
 		name = Undefined();
 	Local<String> source = ToString(src.data, src.len);
-	pfree(src.data);
 
 	Context::Scope	context_scope(global_context);
 	TryCatch		try_catch;
-	Local<Script>	script = Script::New(source, name);
+	ScriptOrigin	origin(name);
+	char		   *cached = NULL;
+	ScriptData	   *pre_data = NULL;
+
+	if (plv8_code_cache && OidIsValid(fn_oid))
+		pre_data = GetScriptData(fn_oid, fn_xmin, src.data, src.len,
+								 source, &cached);
+	pfree(src.data);
+
+	Local<Script>	script = Script::New(source, &origin, pre_data);
+
+	delete pre_data;
+	if (cached)
+		pfree(cached);
 
 	if (script.IsEmpty())
 		throw js_error(try_catch);
@@ -1265,7 +2049,31 @@ GetGlobalContext()
 		Handle<ObjectTemplate>	global = GetGlobalObjectTemplate();
 		plv8_context		   *my_context;
 
-		global_context = Context::New(NULL, global);
+#ifdef PLV8_STARTUP_JS
+		/*
+		 * The startup script is registered as an extension, which v8
+		 * compiles only once and runs in each new context.
+		 */
+		if (plv8_startup_js)
+		{
+			static bool		registered = false;
+			const char	   *names[] = { "plv8/startup" };
+
+			if (!registered)
+			{
+				RegisterExtension(new Extension("plv8/startup",
+							(const char *) startup_js_binary_data));
+				registered = true;
+			}
+
+			ExtensionConfiguration	config(1, names);
+			global_context = Context::New(&config, global);
+		}
+		else
+#endif
+			global_context = Context::New(NULL, global);
+		if (global_context.IsEmpty())
+			throw js_error("could not create global context");
 		my_context = (plv8_context *) MemoryContextAlloc(TopMemoryContext,
 														 sizeof(plv8_context));
 		my_context->context = global_context;
@@ -1372,12 +2180,136 @@ get_plv8_type(PG_FUNCTION_ARGS, int argno)
 	return &proc->argtypes[argno];
 }
 
+/*
+ * Returns the interned symbol for the name in the database encoding.
+ */
+Local<String>
+InternName(const char *name)
+{
+	plv8_name_entry	   *entry;
+	char			   *utf8 = NULL;
+
+	PG_TRY();
+	{
+		entry = (plv8_name_entry *)
+			hash_search(plv8_name_hash, name, HASH_FIND, NULL);
+		if (entry == NULL)
+		{
+			utf8 = (char *) pg_do_encoding_conversion(
+				(unsigned char *) name, strlen(name),
+				GetDatabaseEncoding(), PG_UTF8);
+			if (hash_get_num_entries(plv8_name_hash) < PLV8_MAX_INTERNED_NAMES)
+				entry = (plv8_name_entry *)
+					hash_search(plv8_name_hash, name, HASH_ENTER, NULL);
+		}
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	if (utf8 == NULL)
+		return Local<String>::New(entry->symbol);
+
+	Local<String>	symbol = String::NewSymbol(utf8);
+	if (utf8 != name)
+		pfree(utf8);
+
+	/* The table is full; just return the string. */
+	if (entry == NULL)
+		return symbol;
+
+	new(&entry->symbol) Persistent<String>(Persistent<String>::New(symbol));
+	return symbol;
+}
+
+/*
+ * Returns the cached converter for the descriptor, building it if needed.
+ * The converter is owned by the cache; the caller must not delete it.
+ */
+Converter *
+LookupConverter(TupleDesc tupdesc)
+{
+	plv8_converter_key		key;
+	plv8_converter_cache   *cache;
+	TupleDesc				copy;
+	Converter			   *conv;
+
+	key.typid = tupdesc->tdtypeid;
+	key.typmod = tupdesc->tdtypmod;
+
+	cache = (plv8_converter_cache *)
+		hash_search(plv8_converter_hash, &key, HASH_FIND, NULL);
+	if (cache != NULL)
+	{
+		if (plv8_tupdesc_matches(cache->tupdesc, tupdesc))
+			return cache->conv;
+
+		delete cache->conv;
+		FreeTupleDesc(cache->tupdesc);
+		hash_search(plv8_converter_hash, &key, HASH_REMOVE, NULL);
+	}
+
+	/* The converter allocates its memory under the current context. */
+	MemoryContext	oldcontext = MemoryContextSwitchTo(plv8_converter_context);
+
+	try
+	{
+		PG_TRY();
+		{
+			copy = CreateTupleDescCopy(tupdesc);
+		}
+		PG_CATCH();
+		{
+			throw pg_error();
+		}
+		PG_END_TRY();
+
+		try
+		{
+			conv = new Converter(copy);
+		}
+		catch (...)
+		{
+			FreeTupleDesc(copy);
+			throw;
+		}
+	}
+	catch (...)
+	{
+		MemoryContextSwitchTo(oldcontext);
+		throw;
+	}
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_TRY();
+	{
+		cache = (plv8_converter_cache *)
+			hash_search(plv8_converter_hash, &key, HASH_ENTER, NULL);
+	}
+	PG_CATCH();
+	{
+		delete conv;
+		FreeTupleDesc(copy);
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	cache->tupdesc = copy;
+	cache->conv = conv;
+
+	return conv;
+}
+
 Converter::Converter(TupleDesc tupdesc) :
 	m_tupdesc(tupdesc),
 	m_colnames(tupdesc->natts),
 	m_coltypes(tupdesc->natts),
 	m_is_scalar(false),
-	m_memcontext(NULL)
+	m_memcontext(NULL),
+	m_rowcontext(NULL),
+	m_nstored(0)
 {
 	Init();
 }
@@ -1387,13 +2319,33 @@ Converter::Converter(TupleDesc tupdesc, bool is_scalar) :
 	m_colnames(tupdesc->natts),
 	m_coltypes(tupdesc->natts),
 	m_is_scalar(is_scalar),
-	m_memcontext(NULL)
+	m_memcontext(NULL),
+	m_rowcontext(NULL),
+	m_nstored(0)
 {
 	Init();
 }
 
 Converter::~Converter()
 {
+	for (size_t c = 0; c < m_colnames.size(); c++)
+	{
+		m_colnames[c].Dispose();
+		m_colnames[c].Clear();
+	}
+
+	if (!m_rowtempl.IsEmpty())
+	{
+		m_rowtempl.Dispose();
+		m_rowtempl.Clear();
+	}
+
+	if (!m_colindex.IsEmpty())
+	{
+		m_colindex.Dispose();
+		m_colindex.Clear();
+	}
+
 	if (m_memcontext != NULL)
 	{
 		MemoryContext ctx = CurrentMemoryContext;
@@ -1423,7 +2375,12 @@ Converter::Init()
 {
 	for (int c = 0; c < m_tupdesc->natts; c++)
 	{
-		m_colnames[c] = ToString(NameStr(m_tupdesc->attrs[c]->attname));
+		/*
+		 * Column names are kept in persistent handles so that the converter
+		 * can be used beyond the handle scope it was created in.
+		 */
+		m_colnames[c] = Persistent<String>::New(
+				InternName(NameStr(m_tupdesc->attrs[c]->attname)));
 		PG_TRY();
 		{
 			if (m_memcontext == NULL)
@@ -1445,32 +2402,115 @@ Converter::Init()
 	}
 }
 
-// TODO: use prototype instead of per tuple fields to reduce
-// memory consumption.
+/*
+ * Every row of a tuple descriptor has the same set of properties, so we
+ * build a row object with all the columns once and clone it per tuple.
+ * This way all the rows share one hidden class and the Set() calls below
+ * are plain stores to existing fields, instead of adding properties one
+ * by one and walking the map transitions for each tuple.
+ */
+Local<Object>
+Converter::NewRow()
+{
+	/*
+	 * The converter may be cached and used in the other global contexts,
+	 * so the template must be of the current one.
+	 */
+	if (!m_rowtempl.IsEmpty() &&
+		m_rowtempl->CreationContext() != Context::GetCurrent())
+	{
+		m_rowtempl.Dispose();
+		m_rowtempl.Clear();
+	}
+
+	if (m_rowtempl.IsEmpty())
+	{
+		HandleScope		handle_scope;
+		Local<Object>	templ = Object::New();
+
+		/* Set() of null to __proto__ would drop the prototype. */
+		for (int c = 0; c < m_tupdesc->natts; c++)
+			templ->ForceSet(m_colnames[c], Null());
+		m_rowtempl = Persistent<Object>::New(templ);
+	}
+
+	return m_rowtempl->Clone();
+}
+
 Local<Object>
 Converter::ToValue(HeapTuple tuple)
 {
-	Local<Object>	obj = Object::New();
+	Local<Object>	obj = NewRow();
 
 	for (int c = 0; c < m_tupdesc->natts; c++)
-	{
-		Datum		datum;
-		bool		isnull;
+		obj->Set(m_colnames[c], ToValue(tuple, c));
+
+	return obj;
+}
+
+/*
+ * Convert only the c-th column (starting from 0) of the tuple.
+ */
+Local<v8::Value>
+Converter::ToValue(HeapTuple tuple, int c)
+{
+	Datum		datum;
+	bool		isnull;
 
 #if PG_VERSION_NUM >= 90000
-		datum = heap_getattr(tuple, c + 1, m_tupdesc, &isnull);
+	datum = heap_getattr(tuple, c + 1, m_tupdesc, &isnull);
 #else
-		/*
-		 * Due to the difference between C and C++ rules,
-		 * we cannot call heap_getattr from < 9.0 unfortunately.
-		 */
-		datum = nocachegetattr(tuple, c + 1, m_tupdesc, &isnull);
+	/*
+	 * Due to the difference between C and C++ rules,
+	 * we cannot call heap_getattr from < 9.0 unfortunately.
+	 */
+	datum = nocachegetattr(tuple, c + 1, m_tupdesc, &isnull);
 #endif
 
-		obj->Set(m_colnames[c], ::ToValue(datum, isnull, &m_coltypes[c]));
+	return ::ToValue(datum, isnull, &m_coltypes[c]);
+}
+
+/*
+ * Returns the column number (starting from 0) for the property name,
+ * or -1 if it is not a column.  The lookup table is a JS object built
+ * at the first call, so this is a single hash probe in v8.
+ */
+int
+Converter::ColumnIndex(Handle<String> name)
+{
+	if (m_colindex.IsEmpty())
+	{
+		HandleScope		handle_scope;
+		Local<Object>	index = Object::New();
+
+		/*
+		 * ForceSet defines own properties even for names like __proto__.
+		 * Only the own properties are looked up, so that a column named
+		 * e.g. toString does not find the prototype's one.
+		 */
+		for (int c = 0; c < m_tupdesc->natts; c++)
+			index->ForceSet(m_colnames[c], Int32::New(c));
+		m_colindex = Persistent<Object>::New(index);
 	}
 
-	return obj;
+	if (!m_colindex->HasRealNamedProperty(name))
+		return -1;
+
+	Local<v8::Value>	c = m_colindex->GetRealNamedProperty(name);
+	if (c.IsEmpty() || !c->IsInt32())
+		return -1;
+	return c->Int32Value();
+}
+
+Local<Array>
+Converter::ColumnNames()
+{
+	Local<Array>	names = Array::New(m_tupdesc->natts);
+
+	for (int c = 0; c < m_tupdesc->natts; c++)
+		names->Set(c, m_colnames[c]);
+
+	return names;
 }
 
 Datum
@@ -1489,6 +2529,62 @@ Converter::ToDatum(Handle<v8::Value> value, Tuplestorestate *tupstore)
 			throw js_error(try_catch);
 	}
 
+	/*
+	 * When storing rows into the tuplestore, allocate the per-row garbage
+	 * in our own context and throw it away at the next row, so that the
+	 * memory usage doesn't grow with the number of rows.  The reset is done
+	 * here rather than after the store, because the error thrown in the
+	 * previous call might have its message in the context.
+	 */
+	MemoryContext	oldcontext = NULL;
+
+	if (tupstore)
+	{
+		PG_TRY();
+		{
+			/* m_memcontext is NULL only when there is no column. */
+			if (m_rowcontext == NULL)
+				m_rowcontext = AllocSetContextCreate(
+									m_memcontext ? m_memcontext :
+												   CurrentMemoryContext,
+									"ConverterRowContext",
+									ALLOCSET_DEFAULT_MINSIZE,
+									ALLOCSET_DEFAULT_INITSIZE,
+									ALLOCSET_DEFAULT_MAXSIZE);
+			else
+				MemoryContextReset(m_rowcontext);
+		}
+		PG_CATCH();
+		{
+			throw pg_error();
+		}
+		PG_END_TRY();
+		oldcontext = MemoryContextSwitchTo(m_rowcontext);
+	}
+
+	try
+	{
+		result = FormDatum(value, tupstore, obj);
+	}
+	catch (...)
+	{
+		if (oldcontext)
+			MemoryContextSwitchTo(oldcontext);
+		throw;
+	}
+
+	if (oldcontext)
+		MemoryContextSwitchTo(oldcontext);
+
+	return result;
+}
+
+Datum
+Converter::FormDatum(Handle<v8::Value> value, Tuplestorestate *tupstore,
+					 Handle<Object> obj)
+{
+	Datum	result;
+
 	/*
 	 * Use vector<char> instead of vector<bool> because <bool> version is
 	 * s specialized and different from bool[].
@@ -1502,22 +2598,21 @@ Converter::ToDatum(Handle<v8::Value> value, Tuplestorestate *tupstore)
 		if ((int) names->Length() != m_tupdesc->natts)
 			throw js_error("expected fields and property names have different cardinality");
 
-		for (int c = 0; c < m_tupdesc->natts; c++)
+		/*
+		 * Map each property name to the column by a hash lookup.  With the
+		 * same cardinality, each column is found iff no name is unknown or
+		 * duplicated.
+		 */
+		bool   *found = (bool *) palloc0(sizeof(bool) * m_tupdesc->natts);
+		for (int d = 0; d < m_tupdesc->natts; d++)
 		{
-			bool found = false;
-			CString  colname(m_colnames[c]);
-			for (int d = 0; d < m_tupdesc->natts; d++)
-			{
-				CString fname(names->Get(d));
-				if (strcmp(colname, fname) == 0)
-				{
-					found = true;
-					break;
-				}
-			}
-			if (!found)
+			int		c = ColumnIndex(names->Get(d)->ToString());
+
+			if (c < 0 || found[c])
 				throw js_error("field name / property name mismatch");
+			found[c] = true;
 		}
+		pfree(found);
 	}
 
 	for (int c = 0; c < m_tupdesc->natts; c++)
@@ -1532,6 +2627,7 @@ Converter::ToDatum(Handle<v8::Value> value, Tuplestorestate *tupstore)
 	if (tupstore)
 	{
 		tuplestore_putvalues(tupstore, m_tupdesc, values, nulls);
+		m_nstored++;
 		result = (Datum) 0;
 	}
 	else
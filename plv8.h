@@ -68,7 +68,8 @@ public:
 };
 
 /*
- * When TYPCATEGORY_ARRAY, other fields are for element types.
+ * When TYPCATEGORY_ARRAY, other fields are for element types, and
+ * elemcategory is the category of the element type.
  *
  * Note that postgres doesn't support type modifiers for arguments and result types.
  */
@@ -80,6 +81,7 @@ typedef struct plv8_type
 	bool		byval;
 	char		align;
 	char		category;
+	char		elemcategory;
 	FmgrInfo	fn_input;
 	FmgrInfo	fn_output;
 	v8::ExternalArrayType ext_array;
@@ -108,31 +110,46 @@ private:
 	CString& operator = (const CString&);
 };
 
+extern v8::Local<v8::String> InternName(const char *name);
+
 /*
  * Records in postgres to JSON in v8 converter.
  */
 class Converter
 {
 private:
-	TupleDesc								m_tupdesc;
-	std::vector< v8::Handle<v8::String> >	m_colnames;
-	std::vector< plv8_type >				m_coltypes;
-	bool									m_is_scalar;
-	MemoryContext							m_memcontext;
+	TupleDesc									m_tupdesc;
+	std::vector< v8::Persistent<v8::String> >	m_colnames;
+	std::vector< plv8_type >					m_coltypes;
+	bool										m_is_scalar;
+	MemoryContext								m_memcontext;
+	MemoryContext								m_rowcontext;
+	int											m_nstored;
+	v8::Persistent<v8::Object>					m_rowtempl;
+	v8::Persistent<v8::Object>					m_colindex;
 
 public:
 	Converter(TupleDesc tupdesc);
 	Converter(TupleDesc tupdesc, bool is_scalar);
 	~Converter();
 	v8::Local<v8::Object> ToValue(HeapTuple tuple);
+	v8::Local<v8::Value> ToValue(HeapTuple tuple, int c);
 	Datum	ToDatum(v8::Handle<v8::Value> value, Tuplestorestate *tupstore = NULL);
+	int		StoredCount() { return m_nstored; }
+	int		ColumnIndex(v8::Handle<v8::String> name);
+	v8::Local<v8::Array> ColumnNames();
 
 private:
 	Converter(const Converter&);
 	Converter& operator = (const Converter&);
 	void	Init();
+	v8::Local<v8::Object>	NewRow();
+	Datum	FormDatum(v8::Handle<v8::Value> value, Tuplestorestate *tupstore,
+					  v8::Handle<v8::Object> obj);
 };
 
+extern Converter *LookupConverter(TupleDesc tupdesc);
+
 /*
  * Provide JavaScript JSON object functionality.
  */
@@ -226,6 +243,7 @@ public:
 
 extern v8::Local<v8::Function> find_js_function(Oid fn_oid);
 extern v8::Local<v8::Function> find_js_function_by_name(const char *signature);
+extern void EnsureSPIConnected();
 extern const char *FormatSPIStatus(int status) throw();
 extern v8::Handle<v8::Value> ThrowError(const char *message) throw();
 extern plv8_type *get_plv8_type(PG_FUNCTION_ARGS, int argno);
@@ -235,14 +253,39 @@ extern void plv8_fill_type(plv8_type *type, Oid typid, MemoryContext mcxt = NULL
 extern Oid inferred_datum_type(v8::Handle<v8::Value> value);
 extern Datum ToDatum(v8::Handle<v8::Value> value, bool *isnull, plv8_type *type);
 extern v8::Local<v8::Value> ToValue(Datum datum, bool isnull, plv8_type *type);
+extern v8::Local<v8::Object> CreateExternalArray(void *data, v8::ExternalArrayType array_type, int byte_size, Datum datum, MemoryContext context = NULL);
 extern v8::Local<v8::String> ToString(Datum value, plv8_type *type);
 extern v8::Local<v8::String> ToString(const char *str, int len = -1, int encoding = GetDatabaseEncoding());
+extern bool IsAscii(const char *str, int len);
 extern char *ToCString(const v8::String::Utf8Value &value);
 extern char *ToCStringCopy(const v8::String::Utf8Value &value);
+extern double NumericToDouble(Datum datum);
+extern bool plv8_numeric_as_string;
+extern int plv8_external_string_threshold;
+
+// plv8_cache.cc
+extern bool plv8_code_cache;
+extern char *plv8_cache_lookup(const char *kind, Oid fn_oid, TransactionId fn_xmin,
+				  const char *source, int srclen, int *datalen);
+extern void plv8_cache_store(const char *kind, Oid fn_oid, TransactionId fn_xmin,
+				 const char *source, int srclen, const char *data, int datalen);
+extern void plv8_cache_stats(long *hits, long *misses);
+extern int plv8_cache_purge(void);
+
+// plv8_json.cc
+extern v8::Local<v8::Value> ParseJSON(const char *str, int len);
+extern text *StringifyJSON(v8::Handle<v8::Value> value);
+#if PG_VERSION_NUM >= 90400
+extern v8::Local<v8::Value> JsonbToValue(Datum datum);
+extern Datum ValueToJsonb(v8::Handle<v8::Value> value, bool *isnull);
+#endif
 
 // plv8_func.cc
 extern v8::Handle<v8::Function> CreateYieldFunction(Converter *conv, Tuplestorestate *tupstore);
 extern v8::Handle<v8::Value> Subtransaction(const v8::Arguments& args) throw();
+extern void plv8_evict_plans(void);
+extern void plv8_release_lazy_rows(void);
+extern int plv8_plan_cache_size;
 
 extern void SetupPlv8Functions(v8::Handle<v8::ObjectTemplate> plv8);
 
@@ -0,0 +1,252 @@
+/*-------------------------------------------------------------------------
+ *
+ * plv8_cache.cc : PL/v8 on-disk cache of compiled data.
+ *
+ * Copyright (c) 2009-2012, the PLV8JS Development Group.
+ *-------------------------------------------------------------------------
+ */
+#include "plv8.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+#define delete		delete_
+#define namespace	namespace_
+#define	typeid		typeid_
+#define	typename	typename_
+#define	using		using_
+
+#include "access/hash.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "utils/memutils.h"
+
+#undef delete
+#undef namespace
+#undef typeid
+#undef typename
+#undef using
+} // extern "C"
+
+/*
+ * The cache files are stored in this directory under the data directory,
+ * which is the current directory of the backend.  Each file has a header,
+ * the source text and the data.  The source text is compared on read, so
+ * a hash collision never returns a wrong item.
+ */
+#define PLV8_CACHE_DIR		"plv8_cache"
+#define PLV8_CACHE_MAGIC	0x504c5638		/* "PLV8" */
+
+typedef struct plv8_cache_header
+{
+	uint32		magic;
+	uint32		version;	/* V8 and plv8 version hash */
+	int32		srclen;		/* length of the source text */
+	int32		datalen;	/* length of the data */
+} plv8_cache_header;
+
+/* GUC to enable the cache */
+bool		plv8_code_cache = false;
+
+static long	plv8_cache_hits = 0;
+static long	plv8_cache_misses = 0;
+
+static uint32
+plv8_cache_version(void)
+{
+	static uint32	version = 0;
+
+	if (version == 0)
+	{
+		StringInfoData	buf;
+
+		initStringInfo(&buf);
+		appendStringInfo(&buf, "%s %s", PLV8_VERSION, v8::V8::GetVersion());
+		version = DatumGetUInt32(hash_any((unsigned char *) buf.data, buf.len));
+		pfree(buf.data);
+	}
+
+	return version;
+}
+
+static void
+plv8_cache_path(char *path, const char *kind, Oid fn_oid,
+				TransactionId fn_xmin, const char *source, int srclen)
+{
+	uint32		hash;
+
+	hash = DatumGetUInt32(hash_any((unsigned char *) source, srclen));
+	snprintf(path, MAXPGPATH, "%s/%s_%u_%u_%08x",
+			 PLV8_CACHE_DIR, kind, fn_oid, fn_xmin, hash);
+}
+
+/*
+ * Look up the cached data for the source.  Returns palloc'ed data and sets
+ * the length to *datalen if found, or NULL otherwise.  A broken or stale
+ * file is just ignored.
+ */
+char *
+plv8_cache_lookup(const char *kind, Oid fn_oid, TransactionId fn_xmin,
+				  const char *source, int srclen, int *datalen)
+{
+	char				path[MAXPGPATH];
+	FILE			   *file;
+	plv8_cache_header	header;
+	char			   *buf = NULL;
+	char			   *data = NULL;
+	struct stat			st;
+
+	plv8_cache_path(path, kind, fn_oid, fn_xmin, source, srclen);
+
+	file = AllocateFile(path, PG_BINARY_R);
+	if (file == NULL)
+	{
+		plv8_cache_misses++;
+		return NULL;
+	}
+
+	/*
+	 * The lengths must add up to the file size, so that a broken header
+	 * never makes us allocate a large buffer.
+	 */
+	if (fstat(fileno(file), &st) == 0 &&
+		fread(&header, sizeof(header), 1, file) == 1 &&
+		header.magic == PLV8_CACHE_MAGIC &&
+		header.version == plv8_cache_version() &&
+		header.srclen == srclen &&
+		header.datalen > 0 &&
+		(Size) header.datalen <= MaxAllocSize &&
+		(off_t) (sizeof(header) + srclen + header.datalen) == st.st_size)
+	{
+		buf = (char *) palloc(srclen + 1);
+		data = (char *) palloc(header.datalen);
+		if (fread(buf, 1, srclen, file) != (size_t) srclen ||
+			memcmp(buf, source, srclen) != 0 ||
+			fread(data, 1, header.datalen, file) != (size_t) header.datalen)
+		{
+			pfree(data);
+			data = NULL;
+		}
+		pfree(buf);
+	}
+	FreeFile(file);
+
+	if (data == NULL)
+	{
+		plv8_cache_misses++;
+		return NULL;
+	}
+
+	plv8_cache_hits++;
+	*datalen = header.datalen;
+	return data;
+}
+
+/*
+ * Store the data for the source.  The file is written to a temporary file
+ * and renamed, so that the other backends never read a partial file.
+ * Failures are reported as WARNING, as the cache is only an optimization.
+ */
+void
+plv8_cache_store(const char *kind, Oid fn_oid, TransactionId fn_xmin,
+				 const char *source, int srclen, const char *data, int datalen)
+{
+	char				path[MAXPGPATH];
+	char				tmppath[MAXPGPATH];
+	FILE			   *file;
+	plv8_cache_header	header;
+
+	if (mkdir(PLV8_CACHE_DIR, S_IRWXU) < 0 && errno != EEXIST)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m",
+						PLV8_CACHE_DIR)));
+		return;
+	}
+
+	plv8_cache_path(path, kind, fn_oid, fn_xmin, source, srclen);
+	snprintf(tmppath, MAXPGPATH, "%s.tmp.%d", path, MyProcPid);
+
+	file = AllocateFile(tmppath, PG_BINARY_W);
+	if (file == NULL)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", tmppath)));
+		return;
+	}
+
+	header.magic = PLV8_CACHE_MAGIC;
+	header.version = plv8_cache_version();
+	header.srclen = srclen;
+	header.datalen = datalen;
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+		fwrite(source, 1, srclen, file) != (size_t) srclen ||
+		fwrite(data, 1, datalen, file) != (size_t) datalen)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", tmppath)));
+		FreeFile(file);
+		unlink(tmppath);
+		return;
+	}
+
+	if (FreeFile(file) != 0 || rename(tmppath, path) < 0)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", path)));
+		unlink(tmppath);
+	}
+}
+
+/*
+ * Remove all the cache files, including those of the other sessions and the
+ * stale ones.  The sessions reading them just miss the cache.  Returns the
+ * number of files removed.
+ */
+int
+plv8_cache_purge(void)
+{
+	DIR			   *dir;
+	struct dirent  *de;
+	char			path[MAXPGPATH];
+	int				nremoved = 0;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to purge the code cache")));
+
+	dir = AllocateDir(PLV8_CACHE_DIR);
+	if (dir == NULL)
+		return 0;
+
+	while ((de = ReadDir(dir, PLV8_CACHE_DIR)) != NULL)
+	{
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		snprintf(path, MAXPGPATH, "%s/%s", PLV8_CACHE_DIR, de->d_name);
+		if (unlink(path) == 0)
+			nremoved++;
+		else if (errno != ENOENT)
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not remove file \"%s\": %m", path)));
+	}
+	FreeDir(dir);
+
+	return nremoved;
+}
+
+void
+plv8_cache_stats(long *hits, long *misses)
+{
+	*hits = plv8_cache_hits;
+	*misses = plv8_cache_misses;
+}
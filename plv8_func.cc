@@ -16,12 +16,23 @@ extern "C" {
 #define	typename	typename_
 #define	using		using_
 
+#if PG_VERSION_NUM >= 90300
+#include "access/htup_details.h"
+#endif
+#include "access/hash.h"
+#include "access/tuptoaster.h"
 #include "access/xact.h"
+#if PG_VERSION_NUM < 90300
+#include "catalog/namespace.h"
+#endif
 #include "catalog/pg_type.h"
 #include "executor/spi.h"
 #include "parser/parse_type.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/hsearch.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 
 #undef delete
 #undef namespace
@@ -38,6 +49,7 @@ static Handle<v8::Value> plv8_Execute(const Arguments& args);
 static Handle<v8::Value> plv8_Prepare(const Arguments& args);
 static Handle<v8::Value> plv8_PlanCursor(const Arguments& args);
 static Handle<v8::Value> plv8_PlanExecute(const Arguments& args);
+static Handle<v8::Value> plv8_PlanExecuteMany(const Arguments& args);
 static Handle<v8::Value> plv8_PlanFree(const Arguments& args);
 static Handle<v8::Value> plv8_CursorFetch(const Arguments& args);
 static Handle<v8::Value> plv8_CursorMove(const Arguments& args);
@@ -58,6 +70,8 @@ static Handle<v8::Value> plv8_WinGetFuncArgCurrent(const Arguments& args);
 static Handle<v8::Value> plv8_QuoteLiteral(const Arguments& args);
 static Handle<v8::Value> plv8_QuoteNullable(const Arguments& args);
 static Handle<v8::Value> plv8_QuoteIdent(const Arguments& args);
+static Handle<v8::Value> plv8_CodeCacheStats(const Arguments& args);
+static Handle<v8::Value> plv8_CodeCachePurge(const Arguments& args);
 
 /*
  * Window function API allows to store partition-local memory, but
@@ -121,12 +135,229 @@ public:
 	void exit(bool success);
 };
 
+/*
+ * Result options given to plv8.execute(), plan.execute() and plan.cursor().
+ */
+#define PLV8_RESULT_LAZY		0x01	/* convert columns on first access */
+#define PLV8_RESULT_COLUMNAR	0x02	/* return an array per column */
+
+/*
+ * Rows returned in the lazy mode.  The tuples are copied out of the SPI
+ * tuple table into our own memory context, with the toasted values fetched,
+ * and each row object refers to one of them by the internal fields.  A
+ * column is converted through the named property interceptor when it is
+ * read first, and is kept as a real property of the row afterwards.
+ *
+ * The instance is shared by all the rows of a result through an owner
+ * object, which the rows refer to, and is deleted when the owner is
+ * garbage collected.  The tuples are freed at the end of transaction, after
+ * which the rows cannot read the columns not converted yet.
+ */
+class LazyRows
+{
+private:
+	MemoryContext	m_memcontext;
+	MemoryContext	m_tuplecontext;
+	TupleDesc		m_tupdesc;
+	HeapTuple	   *m_tuples;
+	int				m_ntuples;
+	Converter	   *m_conv;
+	Persistent<v8::Object>	m_owner;
+	LazyRows	   *m_prev;
+	LazyRows	   *m_next;
+
+	/* All the instances whose tuples are not released yet. */
+	static LazyRows *s_head;
+
+public:
+	LazyRows(SPITupleTable *tuptable, int ntuples);
+	~LazyRows();
+	Local<v8::Object> RowTemplate();
+	Local<v8::Object> NewRow(Handle<v8::Object> templ, int row);
+	Converter *GetConverter() { return m_conv; }
+	HeapTuple GetTuple(int row) { return m_tuples ? m_tuples[row] : NULL; }
+	static LazyRows *FromRow(Handle<v8::Object> row);
+	static void ReleaseAll();
+
+private:
+	LazyRows(const LazyRows&);
+	LazyRows& operator = (const LazyRows&);
+	void Release();
+	static void WeakCallback(Persistent<v8::Value> object, void *parameter);
+};
+
+LazyRows *LazyRows::s_head = NULL;
+
 Persistent<ObjectTemplate> PlanTemplate;
 Persistent<ObjectTemplate> CursorTemplate;
 Persistent<ObjectTemplate> WindowObjectTemplate;
+Persistent<ObjectTemplate> LazyRowTemplate;
+Persistent<ObjectTemplate> LazyOwnerTemplate;
+
+/*
+ * Parse the options object, e.g. { lazy: true }.
+ */
+static int
+GetResultOptions(Handle<v8::Value> value)
+{
+	int				options = 0;
+
+	if (value.IsEmpty() || !value->IsObject() || value->IsArray())
+		return options;
+
+	Handle<v8::Object>	obj = Handle<v8::Object>::Cast(value);
+	if (obj->Get(String::NewSymbol("lazy"))->BooleanValue())
+		options |= PLV8_RESULT_LAZY;
+	if (obj->Get(String::NewSymbol("columnar"))->BooleanValue())
+		options |= PLV8_RESULT_COLUMNAR;
+
+	return options;
+}
+
+/*
+ * Build a typed array over a 1-dimensional array datum holding the c-th
+ * column of all the rows.  Returns an empty handle if the column type has
+ * no typed array mapping or the column has NULL.  Since the datum is a
+ * regular array, the result can be returned as plv8_xxxarray as well.
+ */
+static Local<v8::Value>
+ColumnToExternalArray(SPITupleTable *tuptable, int nrows, int c)
+{
+	TupleDesc			tupdesc = tuptable->tupdesc;
+	Oid					typid = tupdesc->attrs[c]->atttypid;
+	ExternalArrayType	array_type;
+	int					elemsize;
+	MemoryContext		context = NULL;
+	ArrayType		   *array = NULL;
+
+	switch (typid)
+	{
+	case INT2OID:
+		array_type = kExternalShortArray;
+		elemsize = sizeof(int16);
+		break;
+	case INT4OID:
+		array_type = kExternalIntArray;
+		elemsize = sizeof(int32);
+		break;
+	case FLOAT4OID:
+		array_type = kExternalFloatArray;
+		elemsize = sizeof(float4);
+		break;
+	case FLOAT8OID:
+		array_type = kExternalDoubleArray;
+		elemsize = sizeof(float8);
+		break;
+	default:
+		return Local<v8::Value>();
+	}
+
+	PG_TRY();
+	{
+		Size		nbytes = ARR_OVERHEAD_NONULLS(1) + (Size) elemsize * nrows;
+		char	   *data;
+
+		if (nbytes > MaxAllocSize)
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("columnar result is too large")));
+
+		/*
+		 * The JS array may outlive the SPI connection, so the data goes in
+		 * a context of its own, which is deleted when the array is garbage
+		 * collected.
+		 */
+		context = AllocSetContextCreate(TopMemoryContext,
+										"PLv8 columnar array",
+										ALLOCSET_SMALL_MINSIZE,
+										ALLOCSET_SMALL_INITSIZE,
+										ALLOCSET_SMALL_MAXSIZE);
+		array = (ArrayType *) MemoryContextAllocZero(context, nbytes);
+		SET_VARSIZE(array, nbytes);
+		array->ndim = 1;
+		array->dataoffset = 0;
+		array->elemtype = typid;
+		ARR_DIMS(array)[0] = nrows;
+		ARR_LBOUND(array)[0] = 1;
+		data = ARR_DATA_PTR(array);
+
+		for (int r = 0; r < nrows; r++)
+		{
+			bool		isnull;
+			Datum		value;
+
+			value = SPI_getbinval(tuptable->vals[r], tupdesc, c + 1, &isnull);
+			if (isnull)
+			{
+				MemoryContextDelete(context);
+				array = NULL;
+				break;
+			}
+
+			switch (typid)
+			{
+			case INT2OID:
+				((int16 *) data)[r] = DatumGetInt16(value);
+				break;
+			case INT4OID:
+				((int32 *) data)[r] = DatumGetInt32(value);
+				break;
+			case FLOAT4OID:
+				((float4 *) data)[r] = DatumGetFloat4(value);
+				break;
+			case FLOAT8OID:
+				((float8 *) data)[r] = DatumGetFloat8(value);
+				break;
+			}
+		}
+	}
+	PG_CATCH();
+	{
+		if (context)
+			MemoryContextDelete(context);
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	if (array == NULL)
+		return Local<v8::Value>();
+
+	return CreateExternalArray(ARR_DATA_PTR(array), array_type,
+							   elemsize * nrows, PointerGetDatum(array),
+							   context);
+}
+
+/*
+ * Convert the SPI result into { colname: array, ... }.
+ */
+static Local<v8::Object>
+SPIResultToColumns(SPITupleTable *tuptable, int nrows)
+{
+	Converter			conv(tuptable->tupdesc);
+	Local<Array>		names = conv.ColumnNames();
+	Local<v8::Object>	result = v8::Object::New();
+
+	for (int c = 0; c < tuptable->tupdesc->natts; c++)
+	{
+		Local<v8::Value>	column;
+
+		column = ColumnToExternalArray(tuptable, nrows, c);
+		if (column.IsEmpty())
+		{
+			Local<Array>	array = Array::New(nrows);
+
+			for (int r = 0; r < nrows; r++)
+				array->Set(r, conv.ToValue(tuptable->vals[r], c));
+			column = array;
+		}
+		result->Set(names->Get(c), column);
+	}
+
+	return result;
+}
 
 static Handle<v8::Value>
-SPIResultToValue(int status)
+SPIResultToValue(int status, int options = 0)
 {
 	Local<v8::Value>	result;
 
@@ -141,11 +372,30 @@ SPIResultToValue(int status)
 	case SPI_OK_UPDATE_RETURNING:
 	{
 		int				nrows = SPI_processed;
-		Converter		conv(SPI_tuptable->tupdesc);
+
+		if (options & PLV8_RESULT_COLUMNAR)
+		{
+			result = SPIResultToColumns(SPI_tuptable, nrows);
+			break;
+		}
+
 		Local<Array>	rows = Array::New(nrows);
 
-		for (int r = 0; r < nrows; r++)
-			rows->Set(r, conv.ToValue(SPI_tuptable->vals[r]));
+		if ((options & PLV8_RESULT_LAZY) && nrows > 0)
+		{
+			LazyRows   *lazy = new LazyRows(SPI_tuptable, nrows);
+			Local<v8::Object>	templ = lazy->RowTemplate();
+
+			for (int r = 0; r < nrows; r++)
+				rows->Set(r, lazy->NewRow(templ, r));
+		}
+		else
+		{
+			Converter		conv(SPI_tuptable->tupdesc);
+
+			for (int r = 0; r < nrows; r++)
+				rows->Set(r, conv.ToValue(SPI_tuptable->vals[r]));
+		}
 
 		result = rows;
 		break;
@@ -195,6 +445,265 @@ SubTranBlock::exit(bool success)
 	SPI_restore_connection();
 }
 
+LazyRows::LazyRows(SPITupleTable *tuptable, int ntuples)
+	: m_memcontext(NULL),
+	  m_tuplecontext(NULL),
+	  m_tupdesc(NULL),
+	  m_tuples(NULL),
+	  m_ntuples(ntuples),
+	  m_conv(NULL),
+	  m_prev(NULL),
+	  m_next(NULL)
+{
+	MemoryContext	oldcontext = CurrentMemoryContext;
+
+	PG_TRY();
+	{
+		/*
+		 * The rows may outlive the SPI connection, so the memory must
+		 * not belong to it.  It is freed when the rows are collected.
+		 */
+		m_memcontext = AllocSetContextCreate(TopMemoryContext,
+											 "PLv8 lazy rows",
+											 ALLOCSET_SMALL_MINSIZE,
+											 ALLOCSET_SMALL_INITSIZE,
+											 ALLOCSET_SMALL_MAXSIZE);
+		m_tuplecontext = AllocSetContextCreate(m_memcontext,
+											 "PLv8 lazy tuples",
+											 ALLOCSET_DEFAULT_MINSIZE,
+											 ALLOCSET_DEFAULT_INITSIZE,
+											 ALLOCSET_DEFAULT_MAXSIZE);
+		MemoryContextSwitchTo(m_memcontext);
+		m_tupdesc = CreateTupleDescCopy(tuptable->tupdesc);
+		MemoryContextSwitchTo(m_tuplecontext);
+		m_tuples = (HeapTuple *) palloc(sizeof(HeapTuple) * ntuples);
+		for (int r = 0; r < ntuples; r++)
+		{
+			HeapTuple	tuple = tuptable->vals[r];
+
+			/*
+			 * The toasted values may be gone once the row is updated or
+			 * vacuumed, so fetch them now.
+			 */
+			if (HeapTupleHasExternal(tuple))
+				m_tuples[r] = toast_flatten_tuple(tuple, tuptable->tupdesc);
+			else
+				m_tuples[r] = heap_copytuple(tuple);
+		}
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(oldcontext);
+		if (m_memcontext)
+			MemoryContextDelete(m_memcontext);
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	/* Converter allocates its memory under the current context. */
+	MemoryContextSwitchTo(m_memcontext);
+	try
+	{
+		m_conv = new Converter(m_tupdesc);
+	}
+	catch (...)
+	{
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextDelete(m_memcontext);
+		throw;
+	}
+	MemoryContextSwitchTo(oldcontext);
+
+	m_next = s_head;
+	if (s_head)
+		s_head->m_prev = this;
+	s_head = this;
+}
+
+LazyRows::~LazyRows()
+{
+	Release();
+	delete m_conv;
+	MemoryContextDelete(m_memcontext);
+}
+
+/*
+ * Free the tuples, and forget this instance in the list.
+ */
+void
+LazyRows::Release()
+{
+	if (m_tuples == NULL)
+		return;
+
+	MemoryContextDelete(m_tuplecontext);
+	m_tuplecontext = NULL;
+	m_tuples = NULL;
+
+	if (m_prev)
+		m_prev->m_next = m_next;
+	else
+		s_head = m_next;
+	if (m_next)
+		m_next->m_prev = m_prev;
+	m_prev = m_next = NULL;
+}
+
+/*
+ * Called at the end of transaction, when the tuples are no longer valid
+ * to read.  The instances are deleted later by GC.
+ */
+void
+LazyRows::ReleaseAll()
+{
+	while (s_head)
+		s_head->Release();
+}
+
+void
+plv8_release_lazy_rows(void)
+{
+	LazyRows::ReleaseAll();
+}
+
+LazyRows *
+LazyRows::FromRow(Handle<v8::Object> row)
+{
+	Handle<v8::Object>	owner = Handle<v8::Object>::Cast(row->GetInternalField(0));
+
+	return static_cast<LazyRows *>(
+			Handle<External>::Cast(owner->GetInternalField(0))->Value());
+}
+
+static Handle<v8::Value>
+LazyRowGetter(Local<String> property, const AccessorInfo& info) throw()
+{
+	Handle<v8::Object>	self = info.Holder();
+	MemoryContext		ctx = CurrentMemoryContext;
+
+	/* Already converted, or overwritten by the script. */
+	if (self->HasRealNamedProperty(property))
+		return Handle<v8::Value>();
+
+	LazyRows   *lazy = LazyRows::FromRow(self);
+	int			row = self->GetInternalField(1)->Int32Value();
+	Converter  *conv = lazy->GetConverter();
+	int			c = conv->ColumnIndex(property);
+
+	if (c < 0)
+		return Handle<v8::Value>();
+
+	try
+	{
+		HeapTuple	tuple = lazy->GetTuple(row);
+
+		if (tuple == NULL || !IsTransactionOrTransactionBlock())
+			throw js_error("lazy row cannot be read out of transaction");
+
+		Local<v8::Value>	value = conv->ToValue(tuple, c);
+
+		/* Keep it as a real property so that we convert only once. */
+		self->ForceSet(property, value);
+		return value;
+	}
+	catch (js_error& e)
+	{
+		return ThrowException(e.error_object());
+	}
+	catch (pg_error& e)
+	{
+		MemoryContextSwitchTo(ctx);
+		ErrorData *edata = CopyErrorData();
+		Handle<String> message = ToString(edata->message);
+		FlushErrorState();
+		FreeErrorData(edata);
+
+		return ThrowException(Exception::Error(message));
+	}
+}
+
+static Handle<Integer>
+LazyRowQuery(Local<String> property, const AccessorInfo& info) throw()
+{
+	Handle<v8::Object>	self = info.Holder();
+	LazyRows   *lazy = LazyRows::FromRow(self);
+
+	if (!self->HasRealNamedProperty(property) &&
+		lazy->GetConverter()->ColumnIndex(property) >= 0)
+		return Integer::New(None);
+
+	return Handle<Integer>();
+}
+
+static Handle<Array>
+LazyRowEnumerator(const AccessorInfo& info) throw()
+{
+	Handle<v8::Object>	self = info.Holder();
+	LazyRows   *lazy = LazyRows::FromRow(self);
+
+	return lazy->GetConverter()->ColumnNames();
+}
+
+/*
+ * Returns an unregistered row object which NewRow() clones.
+ */
+Local<v8::Object>
+LazyRows::RowTemplate()
+{
+	if (LazyRowTemplate.IsEmpty())
+	{
+		Local<ObjectTemplate> templ = ObjectTemplate::New();
+
+		/* We store the owner and the row number here. */
+		templ->SetInternalFieldCount(2);
+		templ->SetNamedPropertyHandler(LazyRowGetter, 0,
+									   LazyRowQuery, 0,
+									   LazyRowEnumerator);
+		LazyRowTemplate = Persistent<ObjectTemplate>::New(templ);
+
+		templ = ObjectTemplate::New();
+		templ->SetInternalFieldCount(1);
+		LazyOwnerTemplate = Persistent<ObjectTemplate>::New(templ);
+	}
+
+	/*
+	 * The rows keep the owner alive, so one weak handle on the owner tells
+	 * when all the rows are collected.
+	 */
+	Local<v8::Object>	owner = LazyOwnerTemplate->NewInstance();
+	owner->SetInternalField(0, External::New(this));
+	m_owner = Persistent<v8::Object>::New(owner);
+	m_owner.MakeWeak(this, WeakCallback);
+
+	Local<v8::Object>	result = LazyRowTemplate->NewInstance();
+	result->SetInternalField(0, owner);
+	result->SetInternalField(1, Int32::New(-1));
+
+	return result;
+}
+
+Local<v8::Object>
+LazyRows::NewRow(Handle<v8::Object> templ, int row)
+{
+	Local<v8::Object>	result = templ->Clone();
+
+	Assert(row >= 0 && row < m_ntuples);
+	result->SetInternalField(1, Int32::New(row));
+
+	return result;
+}
+
+void
+LazyRows::WeakCallback(Persistent<v8::Value> object, void *parameter)
+{
+	LazyRows   *lazy = static_cast<LazyRows *>(parameter);
+
+	object.Dispose();
+	object.Clear();
+	delete lazy;
+}
+
 JSONObject::JSONObject()
 {
 	Handle<Context> context = Context::GetCurrent();
@@ -250,6 +759,8 @@ SetupPlv8Functions(Handle<ObjectTemplate> plv8)
 	SetCallback(plv8, "quote_literal", plv8_QuoteLiteral, attrFull);
 	SetCallback(plv8, "quote_nullable", plv8_QuoteNullable, attrFull);
 	SetCallback(plv8, "quote_ident", plv8_QuoteIdent, attrFull);
+	SetCallback(plv8, "code_cache_stats", plv8_CodeCacheStats, attrFull);
+	SetCallback(plv8, "code_cache_purge", plv8_CodeCachePurge, attrFull);
 
 	plv8->SetInternalFieldCount(PLV8_INTNL_MAX);
 }
@@ -378,6 +889,232 @@ value_get_datum(Handle<v8::Value> value, Oid typid, char *isnull)
 	}
 }
 
+/* GUC to specify the max number of plans of plv8.execute() to keep */
+int			plv8_plan_cache_size = 100;
+
+#if PG_VERSION_NUM >= 90000
+/*
+ * The plans of plv8.execute() with parameters are kept in this cache, so
+ * that running the same statement again skips parsing and planning.  The
+ * parameter types are deduced from the statement, so the statement text
+ * alone identifies the plan.  The entry is keyed by the hash of the text,
+ * and the text is compared on lookup.  The saved plans are revalidated by
+ * the plan cache when the objects they depend on are changed.
+ *
+ * The entries are also linked in the order of use, and the least recently
+ * used ones are evicted when a new one is added beyond the size.  Running
+ * plans are pinned by refcount and never evicted.
+ */
+typedef struct plv8_plan_cache
+{
+	uint32				hash;		/* hash key */
+	char			   *sql;
+#if PG_VERSION_NUM < 90300
+	char			   *search_path;	/* not tracked by the plan cache */
+#endif
+	SPIPlanPtr			plan;
+	plv8_param_state   *parstate;
+	int					refcount;	/* number of running executions */
+	struct plv8_plan_cache *prev;	/* more recently used */
+	struct plv8_plan_cache *next;	/* less recently used */
+} plv8_plan_cache;
+
+static HTAB *plv8_plan_hash = NULL;
+static MemoryContext plv8_plan_context = NULL;
+static plv8_plan_cache *plv8_plan_head = NULL;	/* most recently used */
+static plv8_plan_cache *plv8_plan_tail = NULL;	/* least recently used */
+
+static void
+plv8_free_plan(SPIPlanPtr plan, plv8_param_state *parstate)
+{
+	SPI_freeplan(plan);
+	if (parstate->paramTypes)
+		pfree(parstate->paramTypes);
+	pfree(parstate);
+}
+
+static void
+plv8_unlink_plan(plv8_plan_cache *cache)
+{
+	if (cache->prev)
+		cache->prev->next = cache->next;
+	else
+		plv8_plan_head = cache->next;
+	if (cache->next)
+		cache->next->prev = cache->prev;
+	else
+		plv8_plan_tail = cache->prev;
+	cache->prev = cache->next = NULL;
+}
+
+static void
+plv8_link_plan(plv8_plan_cache *cache)
+{
+	cache->prev = NULL;
+	cache->next = plv8_plan_head;
+	if (plv8_plan_head)
+		plv8_plan_head->prev = cache;
+	else
+		plv8_plan_tail = cache;
+	plv8_plan_head = cache;
+}
+
+/*
+ * Evict the least recently used plans beyond plv8.plan_cache_size, except
+ * for the running ones.
+ */
+static void
+plv8_trim_plans(void)
+{
+	long				nevict;
+	plv8_plan_cache	   *cache = plv8_plan_tail;
+
+	nevict = hash_get_num_entries(plv8_plan_hash) - plv8_plan_cache_size;
+	while (nevict > 0 && cache != NULL)
+	{
+		plv8_plan_cache	   *prev = cache->prev;
+
+		if (cache->refcount == 0)
+		{
+			plv8_unlink_plan(cache);
+			plv8_free_plan(cache->plan, cache->parstate);
+			pfree(cache->sql);
+#if PG_VERSION_NUM < 90300
+			pfree(cache->search_path);
+#endif
+			hash_search(plv8_plan_hash, &cache->hash, HASH_REMOVE, NULL);
+			nevict--;
+		}
+		cache = prev;
+	}
+}
+
+/*
+ * Returns the cache entry of the statement, pinned for the execution, after
+ * preparing and adding it if not found.  The caller must unpin it by
+ * plv8_release_plan.  If another statement has the same hash, the plan is
+ * not cached and NULL is returned, and the caller must free the plan.
+ */
+static plv8_plan_cache *
+plv8_get_plan(const char *sql, SPIPlanPtr *plan, plv8_param_state **parstate)
+{
+	uint32				hash;
+	plv8_plan_cache	   *cache;
+	SPIPlanPtr			initial;
+	SPIPlanPtr			saved;
+	plv8_param_state   *state;
+
+	if (plv8_plan_hash == NULL)
+	{
+		HASHCTL		hash_ctl;
+
+		plv8_plan_context = AllocSetContextCreate(TopMemoryContext,
+									"PLv8 Plans",
+									ALLOCSET_SMALL_MINSIZE,
+									ALLOCSET_SMALL_INITSIZE,
+									ALLOCSET_DEFAULT_MAXSIZE);
+		memset(&hash_ctl, 0, sizeof(hash_ctl));
+		hash_ctl.keysize = sizeof(uint32);
+		hash_ctl.entrysize = sizeof(plv8_plan_cache);
+		hash_ctl.hash = tag_hash;
+		hash_ctl.hcxt = plv8_plan_context;
+		plv8_plan_hash = hash_create("PLv8 Plans", 64, &hash_ctl,
+									 HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+	}
+
+	hash = DatumGetUInt32(hash_any((unsigned char *) sql, strlen(sql)));
+	cache = (plv8_plan_cache *)
+		hash_search(plv8_plan_hash, &hash, HASH_FIND, NULL);
+	if (cache != NULL && strcmp(cache->sql, sql) == 0
+#if PG_VERSION_NUM < 90300
+		&& strcmp(cache->search_path, namespace_search_path) == 0
+#endif
+		)
+	{
+		plv8_unlink_plan(cache);
+		plv8_link_plan(cache);
+		cache->refcount++;
+		*plan = cache->plan;
+		*parstate = cache->parstate;
+		return cache;
+	}
+
+	/*
+	 * The parameter state is kept with the plan, since the parser hook is
+	 * called again when the plan is revalidated.
+	 */
+	state = (plv8_param_state *)
+		MemoryContextAllocZero(plv8_plan_context, sizeof(plv8_param_state));
+	state->memcontext = plv8_plan_context;
+	PG_TRY();
+	{
+		initial = SPI_prepare_params(sql, plv8_variable_param_setup, state, 0);
+		if (initial == NULL)
+			elog(ERROR, "SPI_prepare_params failed: %s",
+				 SPI_result_code_string(SPI_result));
+		saved = SPI_saveplan(initial);
+		SPI_freeplan(initial);
+	}
+	PG_CATCH();
+	{
+		if (state->paramTypes)
+			pfree(state->paramTypes);
+		pfree(state);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	*plan = saved;
+	*parstate = state;
+
+	/* Leave the entry of the other statement, which may be running. */
+	if (cache != NULL)
+		return NULL;
+
+	cache = (plv8_plan_cache *)
+		hash_search(plv8_plan_hash, &hash, HASH_ENTER, NULL);
+	cache->sql = MemoryContextStrdup(plv8_plan_context, sql);
+#if PG_VERSION_NUM < 90300
+	cache->search_path =
+		MemoryContextStrdup(plv8_plan_context, namespace_search_path);
+#endif
+	cache->plan = saved;
+	cache->parstate = state;
+	cache->refcount = 1;
+	plv8_link_plan(cache);
+
+	plv8_trim_plans();
+
+	return cache;
+}
+
+static void
+plv8_release_plan(plv8_plan_cache *cache)
+{
+	Assert(cache->refcount > 0);
+	cache->refcount--;
+}
+#endif	// PG_VERSION_NUM >= 90000
+
+/*
+ * Called at the end of transaction, when no plan is running.  The pins of
+ * the executions skipped by errors are cleared, and the plans beyond the
+ * size are evicted, which may be left when all of them were running or
+ * when the size has been reduced.
+ */
+void
+plv8_evict_plans(void)
+{
+#if PG_VERSION_NUM >= 90000
+	if (plv8_plan_hash == NULL)
+		return;
+
+	for (plv8_plan_cache *cache = plv8_plan_head; cache; cache = cache->next)
+		cache->refcount = 0;
+	plv8_trim_plans();
+#endif
+}
+
 static int
 plv8_execute_params(const char *sql, Handle<Array> params)
 {
@@ -393,23 +1130,49 @@ plv8_execute_params(const char *sql, Handle<Array> params)
  */
 #if PG_VERSION_NUM >= 90000
 	SPIPlanPtr		plan;
-	plv8_param_state parstate = {0};
+	plv8_param_state *parstate;
 	ParamListInfo	paramLI;
+	bool			usecache = plv8_plan_cache_size > 0;
+	plv8_plan_cache *cache = NULL;
 
-	parstate.memcontext = CurrentMemoryContext;
-	plan = SPI_prepare_params(sql, plv8_variable_param_setup,
-							  &parstate, 0);
-	if (parstate.numParams != nparam)
-		elog(ERROR, "parameter numbers mismatch: %d != %d",
-				parstate.numParams, nparam);
-	for (int i = 0; i < nparam; i++)
+	if (usecache)
+		cache = plv8_get_plan(sql, &plan, &parstate);
+	else
 	{
-		Handle<v8::Value>	param = params->Get(i);
-		values[i] = value_get_datum(param,
-								  parstate.paramTypes[i], &nulls[i]);
+		parstate = (plv8_param_state *) palloc0(sizeof(plv8_param_state));
+		parstate->memcontext = CurrentMemoryContext;
+		plan = SPI_prepare_params(sql, plv8_variable_param_setup,
+								  parstate, 0);
+	}
+
+	PG_TRY();
+	{
+		if (parstate->numParams != nparam)
+			elog(ERROR, "parameter numbers mismatch: %d != %d",
+					parstate->numParams, nparam);
+		for (int i = 0; i < nparam; i++)
+		{
+			Handle<v8::Value>	param = params->Get(i);
+			values[i] = value_get_datum(param,
+									  parstate->paramTypes[i], &nulls[i]);
+		}
+		paramLI = plv8_setup_variable_paramlist(parstate, values, nulls);
+		status = SPI_execute_plan_with_paramlist(plan, paramLI, false, 0);
 	}
-	paramLI = plv8_setup_variable_paramlist(&parstate, values, nulls);
-	status = SPI_execute_plan_with_paramlist(plan, paramLI, false, 0);
+	PG_CATCH();
+	{
+		if (cache != NULL)
+			plv8_release_plan(cache);
+		else if (usecache)
+			plv8_free_plan(plan, parstate);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (cache != NULL)
+		plv8_release_plan(cache);
+	else if (usecache)
+		plv8_free_plan(plan, parstate);
 #else
 	Oid			   *types = (Oid *) palloc(sizeof(Oid) * nparam);
 
@@ -434,12 +1197,15 @@ plv8_execute_params(const char *sql, Handle<Array> params)
 }
 
 /*
- * plv8.execute(statement, [param, ...])
+ * plv8.execute(statement, [param, ...], [options])
+ *
+ * The options may be given as the second argument when there is no param.
  */
 static Handle<v8::Value>
 plv8_Execute(const Arguments &args)
 {
 	int				status;
+	int				options = 0;
 
 	if (args.Length() < 1)
 		return Undefined();
@@ -448,10 +1214,22 @@ plv8_Execute(const Arguments &args)
 	Handle<Array>	params;
 
 	if (args.Length() >= 2)
-		params = Handle<Array>::Cast(args[1]);
+	{
+		if (args[1]->IsArray())
+			params = Handle<Array>::Cast(args[1]);
+		else
+			options = GetResultOptions(args[1]);
+	}
+	if (args.Length() >= 3)
+		options = GetResultOptions(args[2]);
 
 	int				nparam = params.IsEmpty() ? 0 : params->Length();
 
+	/*
+	 * Connect before the subtransaction begins, or the connection would be
+	 * closed at its end.  This must be done out of PG_TRY, as it may throw.
+	 */
+	EnsureSPIConnected();
 
 	SubTranBlock	subtran;
 	PG_TRY();
@@ -471,7 +1249,7 @@ plv8_Execute(const Arguments &args)
 
 	subtran.exit(true);
 
-	return SPIResultToValue(status);
+	return SPIResultToValue(status, options);
 }
 
 /*
@@ -487,6 +1265,8 @@ plv8_Prepare(const Arguments &args)
 	Oid			   *types = NULL;
 	plv8_param_state *parstate = NULL;
 
+	EnsureSPIConnected();
+
 	if (args.Length() > 1)
 	{
 		array = Handle<Array>::Cast(args[1]);
@@ -533,6 +1313,7 @@ plv8_Prepare(const Arguments &args)
 		templ->SetInternalFieldCount(2);
 		SetCallback(templ, "cursor", plv8_PlanCursor);
 		SetCallback(templ, "execute", plv8_PlanExecute);
+		SetCallback(templ, "executeMany", plv8_PlanExecuteMany);
 		SetCallback(templ, "free", plv8_PlanFree);
 		PlanTemplate = Persistent<ObjectTemplate>::New(templ);
 	}
@@ -545,7 +1326,7 @@ plv8_Prepare(const Arguments &args)
 }
 
 /*
- * plan.cursor(args, ...)
+ * plan.cursor([args], [options])
  */
 static Handle<v8::Value>
 plv8_PlanCursor(const Arguments &args)
@@ -558,16 +1339,23 @@ plv8_PlanCursor(const Arguments &args)
 	Handle<Array>		params;
 	Portal				cursor;
 	plv8_param_state   *parstate = NULL;
+	int					options = 0;
 
 	plan = static_cast<SPIPlanPtr>(
 			Handle<External>::Cast(self->GetInternalField(0))->Value());
 	/* XXX: Add plan validation */
 
+	EnsureSPIConnected();
+
 	if (args.Length() > 0 && args[0]->IsArray())
 	{
 		params = Handle<Array>::Cast(args[0]);
 		nparam = params->Length();
+		if (args.Length() > 1)
+			options = GetResultOptions(args[1]);
 	}
+	else if (args.Length() > 0)
+		options = GetResultOptions(args[0]);
 
 	/*
 	 * If the plan has the variable param info, use it.
@@ -639,7 +1427,8 @@ plv8_PlanCursor(const Arguments &args)
 		Local<FunctionTemplate> base = FunctionTemplate::New();
 		base->SetClassName(String::NewSymbol("Cursor"));
 		Local<ObjectTemplate> templ = base->InstanceTemplate();
-		templ->SetInternalFieldCount(1);
+		/* We store the cursor name and the result options here. */
+		templ->SetInternalFieldCount(2);
 		SetCallback(templ, "fetch", plv8_CursorFetch);
 		SetCallback(templ, "move", plv8_CursorMove);
 		SetCallback(templ, "close", plv8_CursorClose);
@@ -648,12 +1437,13 @@ plv8_PlanCursor(const Arguments &args)
 
 	Local<v8::Object> result = CursorTemplate->NewInstance();
 	result->SetInternalField(0, cname);
+	result->SetInternalField(1, Int32::New(options));
 
 	return result;
 }
 
 /*
- * plan.execute(args, ...)
+ * plan.execute([args], [options])
  */
 static Handle<v8::Value>
 plv8_PlanExecute(const Arguments &args)
@@ -667,16 +1457,23 @@ plv8_PlanExecute(const Arguments &args)
 	SubTranBlock		subtran;
 	int					status;
 	plv8_param_state   *parstate = NULL;
+	int					options = 0;
 
 	plan = static_cast<SPIPlanPtr>(
 			Handle<External>::Cast(self->GetInternalField(0))->Value());
 	/* XXX: Add plan validation */
 
+	EnsureSPIConnected();
+
 	if (args.Length() > 0 && args[0]->IsArray())
 	{
 		params = Handle<Array>::Cast(args[0]);
 		nparam = params->Length();
+		if (args.Length() > 1)
+			options = GetResultOptions(args[1]);
 	}
+	else if (args.Length() > 0)
+		options = GetResultOptions(args[0]);
 
 	/*
 	 * If the plan has the variable param info, use it.
@@ -742,7 +1539,179 @@ plv8_PlanExecute(const Arguments &args)
 
 	subtran.exit(true);
 
-	return SPIResultToValue(status);
+	return SPIResultToValue(status, options);
+}
+
+/*
+ * plan.executeMany(rows)
+ *
+ * Executes the plan for each array of parameters in rows, and returns the
+ * total number of processed rows.  The parameter types are resolved once,
+ * and all the rows are run in one subtransaction, so that an error undoes
+ * all of them.
+ */
+static Handle<v8::Value>
+plv8_PlanExecuteMany(const Arguments &args)
+{
+	Handle<v8::Object>	self = args.This();
+	SPIPlanPtr			plan;
+	Datum			   *values = NULL;
+	char			   *nulls = NULL;
+	plv8_type		   *types = NULL;
+	int					argcount;
+	Handle<Array>		rows;
+	int					nrows;
+	SubTranBlock		subtran;
+	plv8_param_state   *parstate = NULL;
+	MemoryContext		rowcontext;
+	MemoryContext		oldcontext;
+	double				processed = 0;
+
+	plan = static_cast<SPIPlanPtr>(
+			Handle<External>::Cast(self->GetInternalField(0))->Value());
+
+	if (args.Length() < 1 || !args[0]->IsArray())
+		throw js_error("executeMany expects an array of parameter arrays");
+
+	EnsureSPIConnected();
+
+	rows = Handle<Array>::Cast(args[0]);
+	nrows = rows->Length();
+
+	parstate = static_cast<plv8_param_state *>(
+			Handle<External>::Cast(self->GetInternalField(1))->Value());
+
+	if (parstate)
+		argcount = parstate->numParams;
+	else
+		argcount = SPI_getargcount(plan);
+
+	if (argcount > 0)
+	{
+		values = (Datum *) palloc(sizeof(Datum) * argcount);
+		nulls = (char *) palloc(sizeof(char) * argcount);
+		types = (plv8_type *) palloc0(sizeof(plv8_type) * argcount);
+	}
+
+	for (int i = 0; i < argcount; i++)
+	{
+		Oid		typid;
+
+		if (parstate)
+			typid = parstate->paramTypes[i];
+		else
+			typid = SPI_getargtypeid(plan, i);
+
+		plv8_fill_type(&types[i], typid);
+	}
+
+	/* The parameters of each row are freed before the next row. */
+	rowcontext = AllocSetContextCreate(CurrentMemoryContext,
+									   "PLv8 executeMany",
+									   ALLOCSET_DEFAULT_MINSIZE,
+									   ALLOCSET_DEFAULT_INITSIZE,
+									   ALLOCSET_DEFAULT_MAXSIZE);
+
+	PG_TRY();
+	{
+		subtran.enter();
+	}
+	PG_CATCH();
+	{
+		MemoryContextDelete(rowcontext);
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	for (int r = 0; r < nrows; r++)
+	{
+		int		status;
+
+		MemoryContextReset(rowcontext);
+		oldcontext = MemoryContextSwitchTo(rowcontext);
+
+		try
+		{
+			Handle<v8::Value>	row = rows->Get(r);
+
+			if (!row->IsArray())
+				throw js_error("executeMany expects an array of parameter arrays");
+
+			Handle<Array>	params = Handle<Array>::Cast(row);
+
+			if ((int) params->Length() != argcount)
+			{
+				StringInfoData	buf;
+
+				initStringInfo(&buf);
+				appendStringInfo(&buf,
+						"plan expected %d argument(s), given is %d in row %d",
+						argcount, params->Length(), r + 1);
+				throw js_error(pstrdup(buf.data));
+			}
+
+			for (int i = 0; i < argcount; i++)
+			{
+				Handle<v8::Value>	param = params->Get(i);
+				bool				isnull;
+
+				values[i] = ToDatum(param, &isnull, &types[i]);
+				nulls[i] = isnull ? 'n' : ' ';
+			}
+		}
+		catch (js_error& e)
+		{
+			/* The message may be in rowcontext, so build the error first. */
+			Local<v8::Value>	error = e.error_object();
+
+			MemoryContextSwitchTo(oldcontext);
+			subtran.exit(false);
+			MemoryContextDelete(rowcontext);
+			return ThrowException(error);
+		}
+		catch (pg_error& e)
+		{
+			MemoryContextSwitchTo(oldcontext);
+			subtran.exit(false);
+			MemoryContextDelete(rowcontext);
+			throw;
+		}
+
+		PG_TRY();
+		{
+#if PG_VERSION_NUM >= 90000
+			if (parstate)
+			{
+				ParamListInfo	paramLI;
+
+				paramLI = plv8_setup_variable_paramlist(parstate, values, nulls);
+				status = SPI_execute_plan_with_paramlist(plan, paramLI, false, 0);
+			}
+			else
+#endif
+				status = SPI_execute_plan(plan, values, nulls, false, 0);
+			if (status < 0)
+				elog(ERROR, "%s", FormatSPIStatus(status));
+			processed += SPI_processed;
+			if (SPI_tuptable)
+				SPI_freetuptable(SPI_tuptable);
+		}
+		PG_CATCH();
+		{
+			MemoryContextSwitchTo(oldcontext);
+			subtran.exit(false);
+			MemoryContextDelete(rowcontext);
+			throw pg_error();
+		}
+		PG_END_TRY();
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	subtran.exit(true);
+	MemoryContextDelete(rowcontext);
+
+	return Number::New(processed);
 }
 
 /*
@@ -782,9 +1751,13 @@ plv8_CursorFetch(const Arguments &args)
 {
 	Handle<v8::Object>	self = args.This();
 	CString				cname(self->GetInternalField(0));
-	Portal				cursor = SPI_cursor_find(cname);
+	Portal				cursor;
 	int					nfetch = 1;
 	bool				forward = true, wantarray = false;
+	int					options = self->GetInternalField(1)->Int32Value();
+
+	EnsureSPIConnected();
+	cursor = SPI_cursor_find(cname);
 
 	if (!cursor)
 		throw js_error("cannot find cursor");
@@ -810,7 +1783,24 @@ plv8_CursorFetch(const Arguments &args)
 	}
 	PG_END_TRY();
 
-	if (SPI_processed > 0)
+	if (SPI_processed > 0 && wantarray && (options & PLV8_RESULT_COLUMNAR))
+		return SPIResultToColumns(SPI_tuptable, SPI_processed);
+	else if (SPI_processed > 0 && (options & PLV8_RESULT_LAZY))
+	{
+		LazyRows		   *lazy = new LazyRows(SPI_tuptable, SPI_processed);
+		Local<v8::Object>	templ = lazy->RowTemplate();
+
+		if (!wantarray)
+			return lazy->NewRow(templ, 0);
+		else
+		{
+			Handle<Array> array = Array::New();
+			for (unsigned int i = 0; i < SPI_processed; i++)
+				array->Set(i, lazy->NewRow(templ, i));
+			return array;
+		}
+	}
+	else if (SPI_processed > 0)
 	{
 		Converter			conv(SPI_tuptable->tupdesc);
 
@@ -838,10 +1828,13 @@ plv8_CursorMove(const Arguments& args)
 {
 	Handle<v8::Object>	self = args.This();
 	CString				cname(self->GetInternalField(0));
-	Portal				cursor = SPI_cursor_find(cname);
+	Portal				cursor;
 	int					nmove = 1;
 	bool				forward = true;
 
+	EnsureSPIConnected();
+	cursor = SPI_cursor_find(cname);
+
 	if (!cursor)
 		throw js_error("cannot find cursor");
 
@@ -930,6 +1923,7 @@ plv8_Subtransaction(const Arguments& args)
 	Handle<Function>	func = Handle<Function>::Cast(args[0]);
 	SubTranBlock		subtran;
 
+	EnsureSPIConnected();
 	subtran.enter();
 
 	Handle<v8::Value> emptyargs[] = {};
@@ -1429,3 +2423,40 @@ plv8_QuoteIdent(const Arguments& args)
 
 	return ToString(result);
 }
+
+/*
+ * plv8.code_cache_stats()
+ */
+static Handle<v8::Value>
+plv8_CodeCacheStats(const Arguments& args)
+{
+	long				hits, misses;
+	Local<v8::Object>	result = v8::Object::New();
+
+	plv8_cache_stats(&hits, &misses);
+	result->Set(String::NewSymbol("hits"), Number::New(hits));
+	result->Set(String::NewSymbol("misses"), Number::New(misses));
+
+	return result;
+}
+
+/*
+ * plv8.code_cache_purge()
+ */
+static Handle<v8::Value>
+plv8_CodeCachePurge(const Arguments& args)
+{
+	int		nremoved;
+
+	PG_TRY();
+	{
+		nremoved = plv8_cache_purge();
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	return Int32::New(nremoved);
+}
@@ -0,0 +1,1161 @@
+/*-------------------------------------------------------------------------
+ *
+ * plv8_json.cc : JSON parser and serializer working on v8 values directly.
+ *
+ * Copyright (c) 2009-2012, the PLV8JS Development Group.
+ *-------------------------------------------------------------------------
+ */
+#include "plv8.h"
+#include <math.h>
+
+extern "C" {
+#define delete		delete_
+#define namespace	namespace_
+#define	typeid		typeid_
+#define	typename	typename_
+#define	using		using_
+
+#include "lib/stringinfo.h"
+#include "mb/pg_wchar.h"
+#include "utils/builtins.h"
+#if PG_VERSION_NUM >= 90400
+#include "utils/jsonb.h"
+#include "utils/numeric.h"
+#endif
+
+#undef delete
+#undef namespace
+#undef typeid
+#undef typename
+#undef using
+} // extern "C"
+
+using namespace v8;
+
+/*
+ * The nesting level is limited so that a deep document or a deep object
+ * cannot exhaust the C stack.
+ */
+#define PLV8_JSON_MAX_DEPTH		1000
+
+/*
+ * JSONParser builds v8 values from the UTF-8 JSON text, as JSON.parse()
+ * does, without making a v8 string of the whole text first.
+ */
+class JSONParser
+{
+private:
+	const char	   *m_cur;
+	const char	   *m_end;
+	int				m_depth;
+	StringInfoData	m_buf;		/* for unescaped strings and numbers */
+
+public:
+	JSONParser(const char *str, int len);
+	~JSONParser();
+	Local<v8::Value> Parse();
+
+private:
+	Local<v8::Value> ParseValue();
+	Local<v8::Value> ParseObject();
+	Local<v8::Value> ParseArray();
+	Local<String> ParseString(bool symbol);
+	Local<v8::Value> ParseNumber();
+	void ParseLiteral(const char *literal);
+	void AppendCodePoint(pg_wchar code);
+	int ParseHex4();
+	void SkipSpace()
+	{
+		while (m_cur < m_end &&
+			   (*m_cur == ' ' || *m_cur == '\t' ||
+				*m_cur == '\n' || *m_cur == '\r'))
+			m_cur++;
+	}
+	__attribute__((noreturn)) void Error()
+	{
+		throw js_error("invalid input syntax for type json");
+	}
+};
+
+JSONParser::JSONParser(const char *str, int len)
+	: m_cur(str), m_end(str + len), m_depth(0)
+{
+	initStringInfo(&m_buf);
+}
+
+JSONParser::~JSONParser()
+{
+	pfree(m_buf.data);
+}
+
+Local<v8::Value>
+JSONParser::Parse()
+{
+	HandleScope			handle_scope;
+	Local<v8::Value>	result = ParseValue();
+
+	SkipSpace();
+	if (m_cur != m_end)
+		Error();
+
+	return handle_scope.Close(result);
+}
+
+Local<v8::Value>
+JSONParser::ParseValue()
+{
+	SkipSpace();
+	if (m_cur >= m_end)
+		Error();
+
+	switch (*m_cur)
+	{
+	case '{':
+		return ParseObject();
+	case '[':
+		return ParseArray();
+	case '"':
+		return ParseString(false);
+	case 't':
+		ParseLiteral("true");
+		return Local<v8::Value>::New(True());
+	case 'f':
+		ParseLiteral("false");
+		return Local<v8::Value>::New(False());
+	case 'n':
+		ParseLiteral("null");
+		return Local<v8::Value>::New(Null());
+	default:
+		return ParseNumber();
+	}
+}
+
+Local<v8::Value>
+JSONParser::ParseObject()
+{
+	HandleScope		handle_scope;
+	Local<Object>	obj = Object::New();
+
+	if (++m_depth > PLV8_JSON_MAX_DEPTH)
+		throw js_error("JSON is nested too deeply");
+
+	m_cur++;	/* '{' */
+	SkipSpace();
+	if (m_cur < m_end && *m_cur == '}')
+		m_cur++;
+	else
+	{
+		for (;;)
+		{
+			HandleScope		element_scope;
+
+			SkipSpace();
+			if (m_cur >= m_end || *m_cur != '"')
+				Error();
+			/* Keys are made symbols, as they're mostly repeated. */
+			Local<String>	key = ParseString(true);
+
+			SkipSpace();
+			if (m_cur >= m_end || *m_cur != ':')
+				Error();
+			m_cur++;
+
+			Local<v8::Value>	value = ParseValue();
+
+			/* Set() of __proto__ would change the prototype. */
+			if (key->Length() == 9 && key->Equals(String::NewSymbol("__proto__")))
+				obj->ForceSet(key, value);
+			else
+				obj->Set(key, value);
+
+			SkipSpace();
+			if (m_cur < m_end && *m_cur == ',')
+				m_cur++;
+			else if (m_cur < m_end && *m_cur == '}')
+			{
+				m_cur++;
+				break;
+			}
+			else
+				Error();
+		}
+	}
+
+	m_depth--;
+	return handle_scope.Close(obj);
+}
+
+Local<v8::Value>
+JSONParser::ParseArray()
+{
+	HandleScope		handle_scope;
+	Local<Array>	array = Array::New();
+	uint32			length = 0;
+
+	if (++m_depth > PLV8_JSON_MAX_DEPTH)
+		throw js_error("JSON is nested too deeply");
+
+	m_cur++;	/* '[' */
+	SkipSpace();
+	if (m_cur < m_end && *m_cur == ']')
+		m_cur++;
+	else
+	{
+		for (;;)
+		{
+			HandleScope		element_scope;
+
+			array->Set(length++, ParseValue());
+
+			SkipSpace();
+			if (m_cur < m_end && *m_cur == ',')
+				m_cur++;
+			else if (m_cur < m_end && *m_cur == ']')
+			{
+				m_cur++;
+				break;
+			}
+			else
+				Error();
+		}
+	}
+
+	m_depth--;
+	return handle_scope.Close(array);
+}
+
+/*
+ * Strings without escapes are made from the input directly.  Otherwise,
+ * they're unescaped into m_buf.
+ */
+Local<String>
+JSONParser::ParseString(bool symbol)
+{
+	const char *start = ++m_cur;	/* skip '"' */
+
+	while (m_cur < m_end && *m_cur != '"' && *m_cur != '\\')
+	{
+		if ((unsigned char) *m_cur < 0x20)
+			Error();
+		m_cur++;
+	}
+	if (m_cur >= m_end)
+		Error();
+
+	if (*m_cur == '"')
+	{
+		int		len = m_cur - start;
+
+		m_cur++;
+		return symbol ? String::NewSymbol(start, len) : String::New(start, len);
+	}
+
+	resetStringInfo(&m_buf);
+	appendBinaryStringInfo(&m_buf, start, m_cur - start);
+	while (m_cur < m_end && *m_cur != '"')
+	{
+		if ((unsigned char) *m_cur < 0x20)
+			Error();
+		if (*m_cur != '\\')
+		{
+			appendStringInfoChar(&m_buf, *m_cur++);
+			continue;
+		}
+
+		if (++m_cur >= m_end)
+			Error();
+		switch (*m_cur++)
+		{
+		case '"':	appendStringInfoChar(&m_buf, '"'); break;
+		case '\\':	appendStringInfoChar(&m_buf, '\\'); break;
+		case '/':	appendStringInfoChar(&m_buf, '/'); break;
+		case 'b':	appendStringInfoChar(&m_buf, '\b'); break;
+		case 'f':	appendStringInfoChar(&m_buf, '\f'); break;
+		case 'n':	appendStringInfoChar(&m_buf, '\n'); break;
+		case 'r':	appendStringInfoChar(&m_buf, '\r'); break;
+		case 't':	appendStringInfoChar(&m_buf, '\t'); break;
+		case 'u':
+			{
+				pg_wchar	code = ParseHex4();
+
+				/* Combine the surrogate pair. */
+				if (code >= 0xD800 && code <= 0xDBFF &&
+					m_end - m_cur >= 6 && m_cur[0] == '\\' && m_cur[1] == 'u')
+				{
+					const char *save = m_cur;
+					int			low;
+
+					m_cur += 2;
+					low = ParseHex4();
+					if (low >= 0xDC00 && low <= 0xDFFF)
+						code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+					else
+						m_cur = save;
+				}
+				AppendCodePoint(code);
+			}
+			break;
+		default:
+			Error();
+		}
+	}
+	if (m_cur >= m_end)
+		Error();
+	m_cur++;
+
+	return symbol ? String::NewSymbol(m_buf.data, m_buf.len)
+				  : String::New(m_buf.data, m_buf.len);
+}
+
+int
+JSONParser::ParseHex4()
+{
+	int		code = 0;
+
+	if (m_end - m_cur < 4)
+		Error();
+	for (int i = 0; i < 4; i++)
+	{
+		char	c = *m_cur++;
+
+		code <<= 4;
+		if (c >= '0' && c <= '9')
+			code += c - '0';
+		else if (c >= 'a' && c <= 'f')
+			code += c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			code += c - 'A' + 10;
+		else
+			Error();
+	}
+
+	return code;
+}
+
+void
+JSONParser::AppendCodePoint(pg_wchar code)
+{
+	unsigned char	utf8[4];
+
+	unicode_to_utf8(code, utf8);
+	appendBinaryStringInfo(&m_buf, (char *) utf8, pg_utf_mblen(utf8));
+}
+
+/*
+ * Small integers are made without strtod(), which is the common case.
+ */
+Local<v8::Value>
+JSONParser::ParseNumber()
+{
+	const char *start = m_cur;
+	bool		integer = true;
+	int			ndigits = 0;
+
+	if (m_cur < m_end && *m_cur == '-')
+		m_cur++;
+	if (m_cur < m_end && *m_cur == '0')
+	{
+		m_cur++;
+		ndigits++;
+	}
+	else if (m_cur < m_end && *m_cur >= '1' && *m_cur <= '9')
+	{
+		while (m_cur < m_end && *m_cur >= '0' && *m_cur <= '9')
+		{
+			m_cur++;
+			ndigits++;
+		}
+	}
+	else
+		Error();
+
+	if (m_cur < m_end && *m_cur == '.')
+	{
+		integer = false;
+		m_cur++;
+		if (m_cur >= m_end || *m_cur < '0' || *m_cur > '9')
+			Error();
+		while (m_cur < m_end && *m_cur >= '0' && *m_cur <= '9')
+			m_cur++;
+	}
+	if (m_cur < m_end && (*m_cur == 'e' || *m_cur == 'E'))
+	{
+		integer = false;
+		m_cur++;
+		if (m_cur < m_end && (*m_cur == '+' || *m_cur == '-'))
+			m_cur++;
+		if (m_cur >= m_end || *m_cur < '0' || *m_cur > '9')
+			Error();
+		while (m_cur < m_end && *m_cur >= '0' && *m_cur <= '9')
+			m_cur++;
+	}
+
+	/* -0 is a double in JS. */
+	if (integer && ndigits <= 9 && !(start[0] == '-' && start[1] == '0'))
+	{
+		const char *p = start;
+		int32		value = 0;
+		bool		neg = false;
+
+		if (*p == '-')
+		{
+			neg = true;
+			p++;
+		}
+		for (; p < m_cur; p++)
+			value = value * 10 + (*p - '0');
+
+		return Local<v8::Value>::New(Integer::New(neg ? -value : value));
+	}
+
+	resetStringInfo(&m_buf);
+	appendBinaryStringInfo(&m_buf, start, m_cur - start);
+
+	return Local<v8::Value>::New(Number::New(strtod(m_buf.data, NULL)));
+}
+
+void
+JSONParser::ParseLiteral(const char *literal)
+{
+	int		len = strlen(literal);
+
+	if (m_end - m_cur < len || strncmp(m_cur, literal, len) != 0)
+		Error();
+	m_cur += len;
+}
+
+/*
+ * Parse the JSON text in the database encoding.
+ */
+Local<v8::Value>
+ParseJSON(const char *str, int len)
+{
+	char	   *utf8 = (char *) str;
+
+	if (GetDatabaseEncoding() != PG_UTF8 && !IsAscii(str, len))
+	{
+		PG_TRY();
+		{
+			utf8 = (char *) pg_do_encoding_conversion(
+				(unsigned char *) str, len, GetDatabaseEncoding(), PG_UTF8);
+		}
+		PG_CATCH();
+		{
+			throw pg_error();
+		}
+		PG_END_TRY();
+		if (utf8 != str)
+			len = strlen(utf8);
+	}
+
+	Local<v8::Value>	result;
+
+	try
+	{
+		JSONParser	parser(utf8, len);
+
+		result = parser.Parse();
+	}
+	catch (...)
+	{
+		if (utf8 != str)
+			pfree(utf8);
+		throw;
+	}
+
+	if (utf8 != str)
+		pfree(utf8);
+
+	return result;
+}
+
+/*
+ * JSONSerializer writes v8 values into the StringInfo in UTF-8, as
+ * JSON.stringify() does.  The objects that have toJSON() and the wrapper
+ * objects are passed to JSON.stringify(), which is rare enough.
+ */
+class JSONSerializer
+{
+private:
+	StringInfo						m_buf;
+	std::vector< Handle<Object> >	m_stack;	/* to detect cycles */
+	Handle<String>					m_tojson;
+
+public:
+	JSONSerializer(StringInfo buf)
+		: m_buf(buf), m_tojson(String::NewSymbol("toJSON")) {}
+	bool Serialize(Handle<v8::Value> value);
+
+private:
+	void SerializeString(Handle<String> str);
+	void SerializeArray(Handle<Array> array);
+	void SerializeObject(Handle<Object> obj);
+	bool SerializeByJSON(Handle<v8::Value> value);
+};
+
+/*
+ * Returns false if the value is not serializable, which is omitted in
+ * objects and null in arrays.
+ */
+bool
+JSONSerializer::Serialize(Handle<v8::Value> value)
+{
+	if (value->IsString())
+		SerializeString(Handle<String>::Cast(value));
+	else if (value->IsInt32())
+		appendStringInfo(m_buf, "%d", value->Int32Value());
+	else if (value->IsNumber())
+	{
+		double	number = value->NumberValue();
+
+		if (isinf(number) || isnan(number))
+			appendStringInfoString(m_buf, "null");
+		else
+		{
+			String::Utf8Value	str(value);
+
+			appendBinaryStringInfo(m_buf, *str, str.length());
+		}
+	}
+	else if (value->IsTrue())
+		appendStringInfoString(m_buf, "true");
+	else if (value->IsFalse())
+		appendStringInfoString(m_buf, "false");
+	else if (value->IsNull())
+		appendStringInfoString(m_buf, "null");
+	else if (value->IsUndefined() || value->IsFunction() || !value->IsObject())
+		return false;
+	else
+	{
+		TryCatch		try_catch;
+		Handle<Object>	obj = Handle<Object>::Cast(value);
+		Local<v8::Value> tojson = obj->Get(m_tojson);
+
+		if (tojson.IsEmpty())
+			throw js_error(try_catch);
+		if (tojson->IsFunction() || value->IsStringObject() ||
+			value->IsNumberObject() || value->IsBooleanObject())
+			return SerializeByJSON(value);
+
+		for (size_t i = 0; i < m_stack.size(); i++)
+		{
+			if (m_stack[i]->StrictEquals(obj))
+				throw js_error("cannot serialize a cyclic structure to JSON");
+		}
+		if (m_stack.size() >= PLV8_JSON_MAX_DEPTH)
+			throw js_error("object is nested too deeply for JSON");
+
+		m_stack.push_back(obj);
+		if (value->IsArray())
+			SerializeArray(Handle<Array>::Cast(value));
+		else
+			SerializeObject(obj);
+		m_stack.pop_back();
+	}
+
+	return true;
+}
+
+/*
+ * The string is written in place, and escaped only if needed.
+ */
+void
+JSONSerializer::SerializeString(Handle<String> str)
+{
+	int		len = str->Utf8Length();
+	int		start;
+	int		i;
+
+	appendStringInfoChar(m_buf, '"');
+	enlargeStringInfo(m_buf, len);
+	start = m_buf->len;
+	str->WriteUtf8(m_buf->data + start, len, NULL, String::NO_NULL_TERMINATION);
+
+	for (i = 0; i < len; i++)
+	{
+		unsigned char	c = m_buf->data[start + i];
+
+		if (c < 0x20 || c == '"' || c == '\\')
+			break;
+	}
+
+	if (i == len)
+		m_buf->len += len;
+	else
+	{
+		/* Move the string out and append it with escapes. */
+		char   *raw = (char *) palloc(len - i);
+
+		memcpy(raw, m_buf->data + start + i, len - i);
+		m_buf->len += i;
+		for (int j = 0; j < len - i; j++)
+		{
+			unsigned char	c = raw[j];
+
+			switch (c)
+			{
+			case '"':	appendStringInfoString(m_buf, "\\\""); break;
+			case '\\':	appendStringInfoString(m_buf, "\\\\"); break;
+			case '\b':	appendStringInfoString(m_buf, "\\b"); break;
+			case '\f':	appendStringInfoString(m_buf, "\\f"); break;
+			case '\n':	appendStringInfoString(m_buf, "\\n"); break;
+			case '\r':	appendStringInfoString(m_buf, "\\r"); break;
+			case '\t':	appendStringInfoString(m_buf, "\\t"); break;
+			default:
+				if (c < 0x20)
+					appendStringInfo(m_buf, "\\u%04x", c);
+				else
+					appendStringInfoChar(m_buf, c);
+			}
+		}
+		pfree(raw);
+	}
+
+	appendStringInfoChar(m_buf, '"');
+}
+
+void
+JSONSerializer::SerializeArray(Handle<Array> array)
+{
+	TryCatch	try_catch;
+	uint32		length = array->Length();
+
+	appendStringInfoChar(m_buf, '[');
+	for (uint32 i = 0; i < length; i++)
+	{
+		HandleScope			handle_scope;
+		Local<v8::Value>	value = array->Get(i);
+
+		if (value.IsEmpty())
+			throw js_error(try_catch);
+		if (i > 0)
+			appendStringInfoChar(m_buf, ',');
+		if (!Serialize(value))
+			appendStringInfoString(m_buf, "null");
+	}
+	appendStringInfoChar(m_buf, ']');
+}
+
+void
+JSONSerializer::SerializeObject(Handle<Object> obj)
+{
+	TryCatch		try_catch;
+	Local<Array>	names = obj->GetOwnPropertyNames();
+	uint32			length = names->Length();
+	bool			first = true;
+
+	appendStringInfoChar(m_buf, '{');
+	for (uint32 i = 0; i < length; i++)
+	{
+		HandleScope			handle_scope;
+		Local<v8::Value>	key = names->Get(i);
+		Local<v8::Value>	value = obj->Get(key);
+		int					save = m_buf->len;
+
+		if (value.IsEmpty())
+			throw js_error(try_catch);
+		if (!first)
+			appendStringInfoChar(m_buf, ',');
+		SerializeString(key->ToString());
+		appendStringInfoChar(m_buf, ':');
+		if (Serialize(value))
+			first = false;
+		else
+		{
+			/* Take back the key. */
+			m_buf->len = save;
+			m_buf->data[save] = '\0';
+		}
+	}
+	appendStringInfoChar(m_buf, '}');
+}
+
+bool
+JSONSerializer::SerializeByJSON(Handle<v8::Value> value)
+{
+	TryCatch			try_catch;
+	JSONObject			JSON;
+	Handle<v8::Value>	result = JSON.Stringify(value);
+
+	if (result.IsEmpty())
+		throw js_error(try_catch);
+	if (result->IsUndefined())
+		return false;
+
+	String::Utf8Value	str(result);
+
+	appendBinaryStringInfo(m_buf, *str, str.length());
+	return true;
+}
+
+/*
+ * Serialize the value into the text datum of JSON in the database encoding.
+ * Returns NULL if the value is not serializable, such as a function.
+ */
+text *
+StringifyJSON(Handle<v8::Value> value)
+{
+	StringInfoData	buf;
+	text		   *result;
+
+	initStringInfo(&buf);
+	/* Reserve the varlena header, so that the buffer becomes the result. */
+	appendStringInfoSpaces(&buf, VARHDRSZ);
+
+	try
+	{
+		JSONSerializer	serializer(&buf);
+
+		if (!serializer.Serialize(value))
+		{
+			pfree(buf.data);
+			return NULL;
+		}
+	}
+	catch (...)
+	{
+		pfree(buf.data);
+		throw;
+	}
+
+	if (GetDatabaseEncoding() == PG_UTF8 ||
+		IsAscii(buf.data + VARHDRSZ, buf.len - VARHDRSZ))
+	{
+		result = (text *) buf.data;
+		SET_VARSIZE(result, buf.len);
+		return result;
+	}
+
+	char   *str;
+
+	PG_TRY();
+	{
+		str = (char *) pg_do_encoding_conversion(
+			(unsigned char *) buf.data + VARHDRSZ, buf.len - VARHDRSZ,
+			PG_UTF8, GetDatabaseEncoding());
+		if (str == buf.data + VARHDRSZ)
+			result = cstring_to_text_with_len(str, buf.len - VARHDRSZ);
+		else
+		{
+			result = cstring_to_text(str);
+			pfree(str);
+		}
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	pfree(buf.data);
+	return result;
+}
+
+#if PG_VERSION_NUM >= 90400
+/*
+ * Make the string of jsonb, which is in the database encoding.
+ */
+static Local<String>
+JsonbString(JsonbValue *v, bool symbol)
+{
+	if (symbol && GetDatabaseEncoding() == PG_UTF8)
+		return String::NewSymbol(v->val.string.val, v->val.string.len);
+	return ToString(v->val.string.val, v->val.string.len);
+}
+
+static Local<v8::Value>
+JsonbScalarToValue(JsonbValue *v)
+{
+	switch (v->type)
+	{
+	case jbvNull:
+		return Local<v8::Value>::New(Null());
+	case jbvString:
+		return JsonbString(v, false);
+	case jbvNumeric:
+		return Number::New(NumericToDouble(NumericGetDatum(v->val.numeric)));
+	case jbvBool:
+		return Local<v8::Value>::New(v->val.boolean ? True() : False());
+	default:
+		throw js_error("unexpected jsonb value type");
+	}
+}
+
+/*
+ * Build the array or object which the iterator has just begun.
+ */
+static Local<v8::Value>
+JsonbContainerToValue(JsonbIterator **it, JsonbIteratorToken token,
+					  JsonbValue *v)
+{
+	HandleScope		handle_scope;
+
+	if (token == WJB_BEGIN_ARRAY)
+	{
+		/* A scalar document is stored as an array of one element. */
+		if (v->val.array.rawScalar)
+		{
+			Local<v8::Value>	result;
+
+			token = JsonbIteratorNext(it, v, false);
+			result = JsonbScalarToValue(v);
+			while (token != WJB_DONE)
+				token = JsonbIteratorNext(it, v, false);
+			return handle_scope.Close(result);
+		}
+
+		Local<Array>	array = Array::New(v->val.array.nElems);
+		uint32			i = 0;
+
+		while ((token = JsonbIteratorNext(it, v, false)) != WJB_END_ARRAY)
+		{
+			HandleScope		element_scope;
+
+			if (token == WJB_ELEM)
+				array->Set(i++, JsonbScalarToValue(v));
+			else
+				array->Set(i++, JsonbContainerToValue(it, token, v));
+		}
+		return handle_scope.Close(array);
+	}
+	else
+	{
+		Local<Object>	obj = Object::New();
+
+		while ((token = JsonbIteratorNext(it, v, false)) != WJB_END_OBJECT)
+		{
+			HandleScope			element_scope;
+			Local<String>		key = JsonbString(v, true);
+			Local<v8::Value>	value;
+
+			token = JsonbIteratorNext(it, v, false);
+			if (token == WJB_VALUE)
+				value = JsonbScalarToValue(v);
+			else
+				value = JsonbContainerToValue(it, token, v);
+
+			/* Set() of __proto__ would change the prototype. */
+			if (key->Length() == 9 && key->Equals(String::NewSymbol("__proto__")))
+				obj->ForceSet(key, value);
+			else
+				obj->Set(key, value);
+		}
+		return handle_scope.Close(obj);
+	}
+}
+
+/*
+ * Convert jsonb datum to the v8 value by walking its container, without
+ * printing it to the text.
+ */
+Local<v8::Value>
+JsonbToValue(Datum datum)
+{
+	Jsonb			   *jb;
+	JsonbIterator	   *it;
+	JsonbValue			v;
+	JsonbIteratorToken	token;
+
+	PG_TRY();
+	{
+		jb = DatumGetJsonb(datum);
+		it = JsonbIteratorInit(&jb->root);
+		token = JsonbIteratorNext(&it, &v, false);
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	Local<v8::Value>	result = JsonbContainerToValue(&it, token, &v);
+
+	if ((Pointer) jb != DatumGetPointer(datum))
+		pfree(jb);
+
+	return result;
+}
+
+/*
+ * JsonbBuilder pushes v8 values to the jsonb parse state in the same way
+ * as JSON.stringify() would serialize them.
+ */
+class JsonbBuilder
+{
+private:
+	JsonbParseState				   *m_state;
+	std::vector< Handle<Object> >	m_stack;	/* to detect cycles */
+	Handle<String>					m_tojson;
+
+public:
+	JsonbBuilder()
+		: m_state(NULL), m_tojson(String::NewSymbol("toJSON")) {}
+	Jsonb *Build(Handle<v8::Value> value);
+
+private:
+	Local<v8::Value> Resolve(Handle<v8::Value> value, Handle<v8::Value> key);
+	JsonbValue *Push(JsonbIteratorToken token, JsonbValue *v);
+	JsonbValue *Add(Handle<v8::Value> value, JsonbIteratorToken token);
+	void SetString(JsonbValue *v, Handle<v8::Value> str);
+};
+
+JsonbValue *
+JsonbBuilder::Push(JsonbIteratorToken token, JsonbValue *v)
+{
+	JsonbValue	   *result;
+
+	PG_TRY();
+	{
+		result = pushJsonbValue(&m_state, token, v);
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	return result;
+}
+
+/*
+ * Apply toJSON() and unwrap the wrapper objects.  Returns an empty handle
+ * if the value is not serializable, which is omitted in objects and null
+ * in arrays.
+ */
+Local<v8::Value>
+JsonbBuilder::Resolve(Handle<v8::Value> value, Handle<v8::Value> key)
+{
+	TryCatch	try_catch;
+
+	if (value->IsObject() && !value->IsFunction())
+	{
+		Handle<Object>		obj = Handle<Object>::Cast(value);
+		Local<v8::Value>	tojson = obj->Get(m_tojson);
+
+		if (tojson.IsEmpty())
+			throw js_error(try_catch);
+		if (tojson->IsFunction())
+		{
+			value = Handle<Function>::Cast(tojson)->Call(obj, 1, &key);
+			if (value.IsEmpty())
+				throw js_error(try_catch);
+		}
+	}
+
+	if (value->IsStringObject())
+		return Local<v8::Value>::New(Handle<StringObject>::Cast(value)->StringValue());
+	if (value->IsNumberObject())
+		return Number::New(Handle<NumberObject>::Cast(value)->NumberValue());
+	if (value->IsBooleanObject())
+		return Local<v8::Value>::New(
+			Boolean::New(Handle<BooleanObject>::Cast(value)->BooleanValue()));
+	if (value->IsUndefined() || value->IsFunction())
+		return Local<v8::Value>();
+
+	return Local<v8::Value>::New(value);
+}
+
+/*
+ * Set the string in the database encoding.  jsonb cannot have \u0000 in
+ * strings, since text cannot, so reject it as jsonb_in does.
+ */
+void
+JsonbBuilder::SetString(JsonbValue *v, Handle<v8::Value> str)
+{
+	String::Utf8Value	utf8(str);
+
+	PG_TRY();
+	{
+		if (memchr(*utf8, '\0', utf8.length()) != NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_UNTRANSLATABLE_CHARACTER),
+					 errmsg("unsupported Unicode escape sequence"),
+					 errdetail("\\u0000 cannot be converted to text.")));
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	v->type = jbvString;
+	v->val.string.val = ToCStringCopy(utf8);
+	/* The conversion keeps the string free of NUL. */
+	v->val.string.len = strlen(v->val.string.val);
+}
+
+/*
+ * Push the resolved value.  token is WJB_ELEM or WJB_VALUE for scalars.
+ */
+JsonbValue *
+JsonbBuilder::Add(Handle<v8::Value> value, JsonbIteratorToken token)
+{
+	JsonbValue		v;
+
+	if (value->IsString())
+	{
+		SetString(&v, value);
+		return Push(token, &v);
+	}
+	else if (value->IsNumber())
+	{
+		double	number = value->NumberValue();
+
+		/* JSON has no NaN nor Infinity. */
+		if (isinf(number) || isnan(number))
+			v.type = jbvNull;
+		else
+		{
+			/*
+			 * The shortest round-trip string keeps all the digits, as
+			 * JSON.stringify does; float8_numeric would round to DBL_DIG.
+			 */
+			String::Utf8Value	str(value);
+
+			PG_TRY();
+			{
+				if (value->IsInt32())
+					v.val.numeric = DatumGetNumeric(DirectFunctionCall1(
+						int4_numeric, Int32GetDatum(value->Int32Value())));
+				else
+					v.val.numeric = DatumGetNumeric(DirectFunctionCall3(
+						numeric_in, CStringGetDatum(*str),
+						ObjectIdGetDatum(InvalidOid), Int32GetDatum(-1)));
+			}
+			PG_CATCH();
+			{
+				throw pg_error();
+			}
+			PG_END_TRY();
+			v.type = jbvNumeric;
+		}
+		return Push(token, &v);
+	}
+	else if (value->IsBoolean())
+	{
+		v.type = jbvBool;
+		v.val.boolean = value->IsTrue();
+		return Push(token, &v);
+	}
+	else if (value->IsNull())
+	{
+		v.type = jbvNull;
+		return Push(token, &v);
+	}
+
+	Handle<Object>	obj = Handle<Object>::Cast(value);
+	TryCatch		try_catch;
+	JsonbValue	   *result;
+
+	for (size_t i = 0; i < m_stack.size(); i++)
+	{
+		if (m_stack[i]->StrictEquals(obj))
+			throw js_error("cannot serialize a cyclic structure to JSON");
+	}
+	if (m_stack.size() >= PLV8_JSON_MAX_DEPTH)
+		throw js_error("object is nested too deeply for JSON");
+	m_stack.push_back(obj);
+
+	if (value->IsArray())
+	{
+		Handle<Array>	array = Handle<Array>::Cast(value);
+		uint32			length = array->Length();
+
+		Push(WJB_BEGIN_ARRAY, NULL);
+		for (uint32 i = 0; i < length; i++)
+		{
+			HandleScope			handle_scope;
+			Local<v8::Value>	elem = array->Get(i);
+
+			if (elem.IsEmpty())
+				throw js_error(try_catch);
+			elem = Resolve(elem, Integer::New(i)->ToString());
+			if (elem.IsEmpty())
+				elem = Local<v8::Value>::New(Null());
+			Add(elem, WJB_ELEM);
+		}
+		result = Push(WJB_END_ARRAY, NULL);
+	}
+	else
+	{
+		Local<Array>	names = obj->GetOwnPropertyNames();
+		uint32			length = names->Length();
+
+		Push(WJB_BEGIN_OBJECT, NULL);
+		for (uint32 i = 0; i < length; i++)
+		{
+			HandleScope			handle_scope;
+			Local<v8::Value>	key = names->Get(i);
+			Local<v8::Value>	prop = obj->Get(key);
+
+			if (prop.IsEmpty())
+				throw js_error(try_catch);
+			prop = Resolve(prop, key);
+			if (prop.IsEmpty())
+				continue;
+
+			JsonbValue			k;
+
+			SetString(&k, key);
+			Push(WJB_KEY, &k);
+			Add(prop, WJB_VALUE);
+		}
+		result = Push(WJB_END_OBJECT, NULL);
+	}
+
+	m_stack.pop_back();
+	return result;
+}
+
+Jsonb *
+JsonbBuilder::Build(Handle<v8::Value> value)
+{
+	Local<v8::Value>	resolved = Resolve(value, String::Empty());
+	JsonbValue		   *result;
+
+	if (resolved.IsEmpty())
+		return NULL;
+
+	if (resolved->IsObject())
+		result = Add(resolved, WJB_ELEM);
+	else
+	{
+		/* A scalar document is stored as an array of one element. */
+		JsonbValue	array;
+
+		array.type = jbvArray;
+		array.val.array.rawScalar = true;
+		Push(WJB_BEGIN_ARRAY, &array);
+		Add(resolved, WJB_ELEM);
+		result = Push(WJB_END_ARRAY, NULL);
+	}
+
+	Jsonb	   *jb;
+
+	PG_TRY();
+	{
+		jb = JsonbValueToJsonb(result);
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	return jb;
+}
+
+/*
+ * Convert the v8 value to jsonb without going through the text.  The result
+ * is NULL if the value is not serializable, such as a function.
+ */
+Datum
+ValueToJsonb(Handle<v8::Value> value, bool *isnull)
+{
+	JsonbBuilder	builder;
+	Jsonb		   *jb = builder.Build(value);
+
+	*isnull = (jb == NULL);
+	return PointerGetDatum(jb);
+}
+#endif
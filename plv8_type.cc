@@ -6,6 +6,8 @@
  *-------------------------------------------------------------------------
  */
 #include "plv8.h"
+#include <float.h>
+#include <math.h>
 
 extern "C" {
 #define delete		delete_
@@ -17,12 +19,17 @@ extern "C" {
 #if PG_VERSION_NUM >= 90300
 #include "access/htup_details.h"
 #endif
+#include "access/tuptoaster.h"
 #include "catalog/pg_type.h"
 #include "utils/array.h"
 #include "utils/date.h"
 #include "utils/datetime.h"
 #include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/numeric.h"
 #include "utils/syscache.h"
 #include "utils/typcache.h"
 
@@ -43,21 +50,61 @@ static Datum ToRecordDatum(Handle<v8::Value> value, bool *isnull, plv8_type *typ
 static Local<v8::Value> ToScalarValue(Datum datum, bool isnull, plv8_type *type);
 static Local<v8::Value> ToArrayValue(Datum datum, bool isnull, plv8_type *type);
 static Local<v8::Value> ToRecordValue(Datum datum, bool isnull, plv8_type *type);
+static Local<String> NumericToString(Datum datum);
+static Datum DoubleToNumeric(double value);
+static Local<String> ToExternalString(Datum datum);
 static double TimestampTzToEpoch(TimestampTz tm);
 static Datum EpochToTimestampTz(double epoch);
 static double DateToEpoch(DateADT date);
 static Datum EpochToDate(double epoch);
 
-void
-plv8_fill_type(plv8_type *type, Oid typid, MemoryContext mcxt)
+/* GUC to convert numeric to string instead of number */
+bool		plv8_numeric_as_string = false;
+
+/* GUC of the size in kB above which text is given as an external string */
+int			plv8_external_string_threshold = 1024;
+
+/*
+ * The type information is looked up once per type in the session and kept
+ * in this cache, with the I/O functions resolved.  Any change of pg_type
+ * throws the whole cache away.
+ */
+typedef struct plv8_type_cache
 {
-	bool    ispreferred;
+	Oid			typid;		/* hash key */
+	plv8_type	type;
+} plv8_type_cache;
 
-	if (!mcxt)
-		mcxt = CurrentMemoryContext;
+static HTAB *plv8_type_cache_hash = NULL;
+static MemoryContext plv8_type_cache_context = NULL;
+
+#if PG_VERSION_NUM >= 90200
+static void
+plv8_type_cache_callback(Datum arg, int cacheid, uint32 hashvalue)
+#else
+static void
+plv8_type_cache_callback(Datum arg, int cacheid, ItemPointer tuplePtr)
+#endif
+{
+	/*
+	 * The hash has its own child context, which is not deleted by the reset
+	 * before 9.5.  The reset frees the I/O function info of the entries.
+	 */
+	if (plv8_type_cache_hash != NULL)
+	{
+		hash_destroy(plv8_type_cache_hash);
+		plv8_type_cache_hash = NULL;
+		MemoryContextReset(plv8_type_cache_context);
+	}
+}
 
+static void
+plv8_lookup_type(plv8_type *type, Oid typid)
+{
+	bool    ispreferred;
+
+	memset(type, 0, sizeof(plv8_type));
 	type->typid = typid;
-	type->fn_input.fn_mcxt = type->fn_output.fn_mcxt = mcxt;
 	get_type_category_preferred(typid, &type->category, &ispreferred);
 	get_typlenbyvalalign(typid, &type->len, &type->byval, &type->align);
 
@@ -103,13 +150,10 @@ plv8_fill_type(plv8_type *type, Oid typid, MemoryContext mcxt)
 		else
 			elog(ERROR, "cache lookup failed for type %d", typid);
 
-		if (type->ext_array)
-			return;
-
 		/* If not, do as usual. */
 	}
 
-	if (type->category == TYPCATEGORY_ARRAY)
+	if (type->category == TYPCATEGORY_ARRAY && !type->ext_array)
 	{
 		Oid      elemid = get_element_type(typid);
 
@@ -119,7 +163,83 @@ plv8_fill_type(plv8_type *type, Oid typid, MemoryContext mcxt)
 
 		type->typid = elemid;
 		get_typlenbyvalalign(type->typid, &type->len, &type->byval, &type->align);
+		get_type_category_preferred(elemid, &type->elemcategory, &ispreferred);
+	}
+	else if (typid == RECORDARRAYOID)
+		get_type_category_preferred(RECORDOID, &type->elemcategory, &ispreferred);
+
+	Oid		input_func, output_func;
+	bool	isvarlen;
+
+	getTypeInputInfo(type->typid, &input_func, &type->ioparam);
+	getTypeOutputInfo(type->typid, &output_func, &isvarlen);
+	fmgr_info(input_func, &type->fn_input);
+	fmgr_info(output_func, &type->fn_output);
+}
+
+void
+plv8_fill_type(plv8_type *type, Oid typid, MemoryContext mcxt)
+{
+	plv8_type_cache	   *cache;
+	plv8_type			newtype;
+	plv8_type		   *source;
+
+	if (!mcxt)
+		mcxt = CurrentMemoryContext;
+
+	if (plv8_type_cache_context == NULL)
+	{
+		plv8_type_cache_context = AllocSetContextCreate(TopMemoryContext,
+									"PLv8 Type Cache",
+									ALLOCSET_SMALL_MINSIZE,
+									ALLOCSET_SMALL_INITSIZE,
+									ALLOCSET_SMALL_MAXSIZE);
+		CacheRegisterSyscacheCallback(TYPEOID, plv8_type_cache_callback,
+									  (Datum) 0);
+	}
+
+	if (plv8_type_cache_hash == NULL)
+	{
+		HASHCTL		hash_ctl;
+
+		memset(&hash_ctl, 0, sizeof(hash_ctl));
+		hash_ctl.keysize = sizeof(Oid);
+		hash_ctl.entrysize = sizeof(plv8_type_cache);
+		hash_ctl.hash = tag_hash;
+		hash_ctl.hcxt = plv8_type_cache_context;
+		plv8_type_cache_hash = hash_create("PLv8 Types", 64, &hash_ctl,
+									HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+	}
+
+	cache = (plv8_type_cache *)
+		hash_search(plv8_type_cache_hash, &typid, HASH_FIND, NULL);
+	if (cache != NULL)
+		source = &cache->type;
+	else
+	{
+		/*
+		 * The lookup may accept invalidations and flush the cache, so enter
+		 * the entry only after it's done.  The function info is looked up
+		 * in the current context for the same reason, and copied into the
+		 * cache context, which is reset with the cache.
+		 */
+		plv8_lookup_type(&newtype, typid);
+		source = &newtype;
+		if (plv8_type_cache_hash != NULL)
+		{
+			cache = (plv8_type_cache *)
+				hash_search(plv8_type_cache_hash, &typid, HASH_ENTER, NULL);
+			memcpy(&cache->type, &newtype, sizeof(plv8_type));
+			fmgr_info_copy(&cache->type.fn_input, &newtype.fn_input,
+						   plv8_type_cache_context);
+			fmgr_info_copy(&cache->type.fn_output, &newtype.fn_output,
+						   plv8_type_cache_context);
+		}
 	}
+
+	memcpy(type, source, sizeof(plv8_type));
+	fmgr_info_copy(&type->fn_input, &source->fn_input, mcxt);
+	fmgr_info_copy(&type->fn_output, &source->fn_output, mcxt);
 }
 
 /*
@@ -152,16 +272,35 @@ inferred_datum_type(Handle<v8::Value> value)
 	return InvalidOid;
 }
 
-static Local<Object>
+static void
+ExternalArrayWeakCallback(Persistent<v8::Value> object, void *parameter)
+{
+	MemoryContext	context = static_cast<MemoryContext>(parameter);
+	Handle<Object>	array = Handle<Object>::Cast(object);
+	void		   *datum =
+		Handle<External>::Cast(array->GetInternalField(0))->Value();
+
+	V8::AdjustAmountOfExternalAllocatedMemory(-(intptr_t) VARSIZE_ANY(datum));
+	object.Dispose();
+	object.Clear();
+	MemoryContextDelete(context);
+}
+
+/*
+ * Create an external array over the data in the datum.  If context is
+ * given, the datum is in that context, which is deleted when the array is
+ * garbage collected.  Otherwise the datum must outlive the array.
+ */
+Local<Object>
 CreateExternalArray(void *data, ExternalArrayType array_type, int byte_size,
-					Datum datum)
+					Datum datum, MemoryContext context)
 {
 	static Persistent<ObjectTemplate> externalArray;
 
 	if (externalArray.IsEmpty())
 	{
 		externalArray = Persistent<ObjectTemplate>::New(ObjectTemplate::New());
-		externalArray->SetInternalFieldCount(1);
+		externalArray->SetInternalFieldCount(2);
 	}
 
 	Local<Object> array = externalArray->NewInstance();
@@ -194,6 +333,16 @@ CreateExternalArray(void *data, ExternalArrayType array_type, int byte_size,
 			data, array_type, length);
 	array->Set(String::New("length"), Int32::New(length), ReadOnly);
 	array->SetInternalField(0, External::New(DatumGetPointer(datum)));
+	array->SetInternalField(1, Boolean::New(context != NULL));
+
+	if (context)
+	{
+		Persistent<Object>	weak = Persistent<Object>::New(array);
+
+		weak.MakeWeak(context, ExternalArrayWeakCallback);
+		V8::AdjustAmountOfExternalAllocatedMemory(
+			VARSIZE_ANY(DatumGetPointer(datum)));
+	}
 
 	return array;
 }
@@ -209,7 +358,21 @@ ExtractExternalArrayDatum(Handle<v8::Value> value)
 		Handle<Object> object = Handle<Object>::Cast(value);
 		if (object->GetIndexedPropertiesExternalArrayData())
 		{
-			return Handle<External>::Cast(object->GetInternalField(0))->Value();
+			void   *datum =
+				Handle<External>::Cast(object->GetInternalField(0))->Value();
+
+			/*
+			 * The datum owned by the array may be freed by GC before the
+			 * result is used, so return a copy.
+			 */
+			if (object->GetInternalField(1)->BooleanValue())
+			{
+				void   *copy = palloc(VARSIZE_ANY(datum));
+
+				memcpy(copy, datum, VARSIZE_ANY(datum));
+				datum = copy;
+			}
+			return datum;
 		}
 	}
 
@@ -279,9 +442,11 @@ ToScalarDatum(Handle<v8::Value> value, bool *isnull, plv8_type *type)
 			return Float8GetDatum((float8) value->NumberValue());
 		break;
 	case NUMERICOID:
+		if (value->IsInt32())
+			return DirectFunctionCall1(int4_numeric,
+					Int32GetDatum(value->Int32Value()));
 		if (value->IsNumber())
-			return DirectFunctionCall1(float8_numeric,
-					Float8GetDatum((float8) value->NumberValue()));
+			return DoubleToNumeric(value->NumberValue());
 		break;
 	case DATEOID:
 		if (value->IsDate())
@@ -304,14 +469,22 @@ ToScalarDatum(Handle<v8::Value> value, bool *isnull, plv8_type *type)
 	case JSONOID:
 		if (value->IsObject() || value->IsArray())
 		{
-			JSONObject JSON;
+			text   *result = StringifyJSON(value);
 
-			Handle<v8::Value> result = JSON.Stringify(value);
-			CString str(result);
-
-			return CStringGetTextDatum(str);
+			if (result == NULL)
+			{
+				*isnull = true;
+				return (Datum) 0;
+			}
+			return PointerGetDatum(result);
 		}
 		break;
+#endif
+#if PG_VERSION_NUM >= 90400
+	case JSONBOID:
+		if (value->IsObject() || value->IsArray())
+			return ValueToJsonb(value, isnull);
+		break;
 #endif
 	}
 
@@ -339,14 +512,66 @@ ToScalarDatum(Handle<v8::Value> value, bool *isnull, plv8_type *type)
 	return result;
 }
 
+/*
+ * Nested JS arrays are mapped to a multi-dimensional array, except for json
+ * elements, where an inner array is a JSON value by itself.
+ */
+static bool
+IsNestedArrayType(plv8_type *type)
+{
+#if PG_VERSION_NUM >= 90200
+	if (type->typid == JSONOID)
+		return false;
+#endif
+#if PG_VERSION_NUM >= 90400
+	if (type->typid == JSONBOID)
+		return false;
+#endif
+	return true;
+}
+
+static void
+FlattenArray(Handle<Array> array, int ndims, int *dims, bool nested,
+			 Datum *values, bool *nulls, int *pos, plv8_type *type)
+{
+	if ((int) array->Length() != dims[0])
+		throw js_error("multidimensional arrays must have array expressions "
+					   "with matching dimensions");
+
+	for (int i = 0; i < dims[0]; i++)
+	{
+		Handle<v8::Value>	elem = array->Get(i);
+
+		if (ndims > 1)
+		{
+			if (!elem->IsArray())
+				throw js_error("multidimensional arrays must have array "
+							   "expressions with matching dimensions");
+			FlattenArray(Handle<Array>::Cast(elem), ndims - 1, dims + 1,
+						 nested, values, nulls, pos, type);
+		}
+		else
+		{
+			if (nested && elem->IsArray())
+				throw js_error("multidimensional arrays must have array "
+							   "expressions with matching dimensions");
+			values[*pos] = ToScalarDatum(elem, &nulls[*pos], type);
+			(*pos)++;
+		}
+	}
+}
+
 static Datum
 ToArrayDatum(Handle<v8::Value> value, bool *isnull, plv8_type *type)
 {
-	int			length;
+	int			nitems;
+	int			pos = 0;
 	Datum	   *values;
 	bool	   *nulls;
-	int			ndims[1];
-	int			lbs[] = {1};
+	int			ndims = 0;
+	int			dims[MAXDIM];
+	int			lbs[MAXDIM];
+	bool		nested = IsNestedArrayType(type);
 	ArrayType  *result;
 
 	if (value->IsUndefined() || value->IsNull())
@@ -366,14 +591,36 @@ ToArrayDatum(Handle<v8::Value> value, bool *isnull, plv8_type *type)
 	if (array.IsEmpty() || !array->IsArray())
 		throw js_error("value is not an Array");
 
-	length = array->Length();
-	values = (Datum *) palloc(sizeof(Datum) * length);
-	nulls = (bool *) palloc(sizeof(bool) * length);
-	ndims[0] = length;
-	for (int i = 0; i < length; i++)
-		values[i] = ToScalarDatum(array->Get(i), &nulls[i], type);
+	/*
+	 * The dimensions are taken from the first element of each level, and
+	 * the other elements are checked to match them while flattening.
+	 */
+	nitems = 1;
+	for (Handle<Array> a = array;;)
+	{
+		if (ndims >= MAXDIM)
+			throw js_error("number of array dimensions exceeds the maximum allowed");
+		dims[ndims] = a->Length();
+		lbs[ndims] = 1;
+		if (dims[ndims] > 0 &&
+			nitems > (int) (MaxAllocSize / sizeof(Datum)) / dims[ndims])
+			throw js_error("array size exceeds the maximum allowed");
+		nitems *= dims[ndims];
+		ndims++;
+
+		if (!nested || dims[ndims - 1] == 0)
+			break;
+		Handle<v8::Value>	first = a->Get(0);
+		if (!first->IsArray())
+			break;
+		a = Handle<Array>::Cast(first);
+	}
+
+	values = (Datum *) palloc(sizeof(Datum) * Max(nitems, 1));
+	nulls = (bool *) palloc(sizeof(bool) * Max(nitems, 1));
+	FlattenArray(array, ndims, dims, nested, values, nulls, &pos, type);
 
-	result = construct_md_array(values, nulls, 1, ndims, lbs,
+	result = construct_md_array(values, nulls, ndims, dims, lbs,
 				type->typid, type->len, type->byval, type->align);
 	pfree(values);
 	pfree(nulls);
@@ -404,9 +651,7 @@ ToRecordDatum(Handle<v8::Value> value, bool *isnull, plv8_type *type)
 	}
 	PG_END_TRY();
 
-	Converter	conv(tupdesc);
-
-	result = conv.ToDatum(value);
+	result = LookupConverter(tupdesc)->ToDatum(value);
 
 	ReleaseTupleDesc(tupdesc);
 
@@ -447,8 +692,9 @@ ToScalarValue(Datum datum, bool isnull, plv8_type *type)
 	case FLOAT8OID:
 		return Number::New(DatumGetFloat8(datum));
 	case NUMERICOID:
-		return Number::New(DatumGetFloat8(
-			DirectFunctionCall1(numeric_float8, datum)));
+		if (plv8_numeric_as_string)
+			return NumericToString(datum);
+		return Number::New(NumericToDouble(datum));
 	case DATEOID:
 		return Date::New(DateToEpoch(DatumGetDateADT(datum)));
 	case TIMESTAMPOID:
@@ -459,6 +705,11 @@ ToScalarValue(Datum datum, bool isnull, plv8_type *type)
 	case BPCHAROID:
 	case XMLOID:
 	{
+		if (plv8_external_string_threshold >= 0 &&
+			toast_raw_datum_size(datum) - VARHDRSZ >=
+				(Size) plv8_external_string_threshold * 1024)
+			return ToExternalString(datum);
+
 		void	   *p = PG_DETOAST_DATUM_PACKED(datum);
 		const char *str = VARDATA_ANY(p);
 		int			len = VARSIZE_ANY_EXHDR(p);
@@ -471,6 +722,11 @@ ToScalarValue(Datum datum, bool isnull, plv8_type *type)
 	}
 	case BYTEAOID:
 	{
+		/*
+		 * The script may modify the external array, so it must not refer
+		 * to the caller's datum.  A toasted value is detoasted to a new
+		 * memory without another copy.
+		 */
 		void	   *p = PG_DETOAST_DATUM_COPY(datum);
 
 		return CreateExternalArray(VARDATA_ANY(p),
@@ -485,20 +741,103 @@ ToScalarValue(Datum datum, bool isnull, plv8_type *type)
 		const char *str = VARDATA_ANY(p);
 		int			len = VARSIZE_ANY_EXHDR(p);
 
-		Local<v8::Value>	jsonString = ToString(str, len);
-		JSONObject JSON;
-		Local<v8::Value> result = Local<v8::Value>::New(JSON.Parse(jsonString));
+		Local<v8::Value>	result = ParseJSON(str, len);
 
 		if (p != DatumGetPointer(datum))
 			pfree(p);	// free if detoasted
 		return result;
 	}
+#endif
+#if PG_VERSION_NUM >= 90400
+	case JSONBOID:
+		return JsonbToValue(datum);
 #endif
 	default:
 		return ToString(datum, type);
 	}
 }
 
+/*
+ * Convert the elements of one dimension.  The common element types are
+ * converted in their own loops, rather than through ToValue each.
+ */
+static void
+ToElementValues(Local<Array> result, Datum *values, bool *nulls, int nelems,
+				plv8_type *type)
+{
+	int			i;
+
+	switch (type->typid)
+	{
+	case INT2OID:
+		for (i = 0; i < nelems; i++)
+			result->Set(i, nulls[i] ? Local<v8::Value>(*Null()) :
+						Local<v8::Value>(Int32::New(DatumGetInt16(values[i]))));
+		break;
+	case INT4OID:
+		for (i = 0; i < nelems; i++)
+			result->Set(i, nulls[i] ? Local<v8::Value>(*Null()) :
+						Local<v8::Value>(Int32::New(DatumGetInt32(values[i]))));
+		break;
+	case FLOAT4OID:
+		for (i = 0; i < nelems; i++)
+			result->Set(i, nulls[i] ? Local<v8::Value>(*Null()) :
+						Local<v8::Value>(Number::New(DatumGetFloat4(values[i]))));
+		break;
+	case FLOAT8OID:
+		for (i = 0; i < nelems; i++)
+			result->Set(i, nulls[i] ? Local<v8::Value>(*Null()) :
+						Local<v8::Value>(Number::New(DatumGetFloat8(values[i]))));
+		break;
+	case TEXTOID:
+	case VARCHAROID:
+	case BPCHAROID:
+		/* Array elements are never toasted, but may be packed. */
+		for (i = 0; i < nelems; i++)
+		{
+			if (nulls[i])
+				result->Set(i, Null());
+			else
+			{
+				void	   *p = DatumGetPointer(values[i]);
+
+				result->Set(i, ToString(VARDATA_ANY(p), VARSIZE_ANY_EXHDR(p)));
+			}
+		}
+		break;
+	default:
+		for (i = 0; i < nelems; i++)
+			result->Set(i, ToValue(values[i], nulls[i], type));
+		break;
+	}
+}
+
+/*
+ * Build nested JS arrays from the flat elements, one level per dimension.
+ */
+static Local<Array>
+ToNestedArray(Datum *values, bool *nulls, int ndims, int *dims, int *pos,
+			  plv8_type *type)
+{
+	/* An empty array has no dimension. */
+	int				nelems = ndims > 0 ? dims[0] : 0;
+	Local<Array>	result = Array::New(nelems);
+
+	if (ndims > 1)
+	{
+		for (int i = 0; i < nelems; i++)
+			result->Set(i, ToNestedArray(values, nulls, ndims - 1, dims + 1,
+										 pos, type));
+	}
+	else
+	{
+		ToElementValues(result, values + *pos, nulls + *pos, nelems, type);
+		*pos += nelems;
+	}
+
+	return result;
+}
+
 static Local<v8::Value>
 ToArrayValue(Datum datum, bool isnull, plv8_type *type)
 {
@@ -514,39 +853,53 @@ ToArrayValue(Datum datum, bool isnull, plv8_type *type)
 		ArrayType   *array = DatumGetArrayTypePCopy(datum);
 
 		/*
-		 * We allow only non-NULL, 1-dim array.
+		 * We allow only non-NULL array.  A multi-dimensional array is given
+		 * as a flat array with its dimensions in "dims".
 		 */
-		if (!ARR_HASNULL(array) && ARR_NDIM(array) <= 1)
+		if (!ARR_HASNULL(array))
 		{
+			int			ndims = ARR_NDIM(array);
 			int			data_bytes = ARR_SIZE(array) -
-										ARR_OVERHEAD_NONULLS(1);
-			return CreateExternalArray(ARR_DATA_PTR(array),
-									   type->ext_array,
-									   data_bytes,
-									   PointerGetDatum(array));
+										ARR_OVERHEAD_NONULLS(ndims);
+			Local<Object>	result =
+				CreateExternalArray(ARR_DATA_PTR(array),
+									type->ext_array,
+									data_bytes,
+									PointerGetDatum(array));
+
+			if (ndims > 1)
+			{
+				Local<Array>	dims = Array::New(ndims);
+
+				for (int i = 0; i < ndims; i++)
+					dims->Set(i, Int32::New(ARR_DIMS(array)[i]));
+				result->Set(String::NewSymbol("dims"), dims);
+			}
+			return result;
 		}
 
-		throw js_error("NULL element, or multi-dimension array not allowed"
-						" in external array type");
+		throw js_error("NULL element not allowed in external array type");
 	}
 
-	deconstruct_array(DatumGetArrayTypeP(datum),
+	ArrayType  *array = DatumGetArrayTypeP(datum);
+
+	deconstruct_array(array,
 						type->typid, type->len, type->byval, type->align,
 						&values, &nulls, &nelems);
-	Local<Array>  result = Array::New(nelems);
-	plv8_type base = { 0 };
-	bool    ispreferred;
 
-	base.typid = type->typid;
+	/*
+	 * The element type shares the information with the array type, which
+	 * is resolved in plv8_fill_type, but for the category.
+	 */
+	plv8_type	base = *type;
+
 	if (base.typid == RECORDARRAYOID)
 		base.typid = RECORDOID;
+	base.category = type->elemcategory;
 
-	base.fn_input.fn_mcxt = base.fn_output.fn_mcxt = type->fn_input.fn_mcxt;
-	get_type_category_preferred(base.typid, &(base.category), &ispreferred);
-	get_typlenbyvalalign(base.typid, &(base.len), &(base.byval), &(base.align));
-
-	for (int i = 0; i < nelems; i++)
-		result->Set(i, ToValue(values[i], nulls[i], &base));
+	int			pos = 0;
+	Local<Array>	result = ToNestedArray(values, nulls,
+						ARR_NDIM(array), ARR_DIMS(array), &pos, &base);
 
 	pfree(values);
 	pfree(nulls);
@@ -576,7 +929,7 @@ ToRecordValue(Datum datum, bool isnull, plv8_type *type)
 	}
 	PG_END_TRY();
 
-	Converter	conv(tupdesc);
+	Converter  *conv = LookupConverter(tupdesc);
 
 	/* Build a temporary HeapTuple control structure */
 	tuple.t_len = HeapTupleHeaderGetDatumLength(rec);
@@ -584,7 +937,7 @@ ToRecordValue(Datum datum, bool isnull, plv8_type *type)
 	tuple.t_tableOid = InvalidOid;
 	tuple.t_data = rec;
 
-	Local<v8::Value> result = conv.ToValue(&tuple);
+	Local<v8::Value> result = conv->ToValue(&tuple);
 
 	ReleaseTupleDesc(tupdesc);
 
@@ -615,15 +968,39 @@ ToString(Datum value, plv8_type *type)
 	}
 	PG_END_TRY();
 
-	Local<String>	result =
-		encoding == PG_UTF8
-			? String::New(str)
-			: ToString(str, strlen(str), encoding);
+	Local<String>	result = ToString(str, strlen(str), encoding);
 	pfree(str);
 
 	return result;
 }
 
+/*
+ * Returns true if the string has only ASCII characters, which are the same
+ * in UTF-8 and all the server encodings, so that no conversion is needed.
+ * The bytes are checked a word at a time.
+ */
+bool
+IsAscii(const char *str, int len)
+{
+	const char *end = str + len;
+
+	for (; end - str >= (int) sizeof(uint64); str += sizeof(uint64))
+	{
+		uint64		word;
+
+		memcpy(&word, str, sizeof(uint64));
+		if (word & UINT64CONST(0x8080808080808080))
+			return false;
+	}
+	for (; str < end; str++)
+	{
+		if (IS_HIGHBIT_SET(*str))
+			return false;
+	}
+
+	return true;
+}
+
 Local<String>
 ToString(const char *str, int len, int encoding)
 {
@@ -632,6 +1009,25 @@ ToString(const char *str, int len, int encoding)
 	if (len < 0)
 		len = strlen(str);
 
+	if (encoding == PG_UTF8 || encoding == PG_SQL_ASCII || IsAscii(str, len))
+		return String::New(str, len);
+
+	/*
+	 * LATIN1 characters are the first 256 code points of Unicode, so they
+	 * are given to V8 as they are, without the conversion to UTF-8.
+	 */
+	if (encoding == PG_LATIN1)
+	{
+		uint16_t   *chars = (uint16_t *) palloc(sizeof(uint16_t) * len);
+
+		for (int i = 0; i < len; i++)
+			chars[i] = (unsigned char) str[i];
+
+		Local<String> result = String::New(chars, len);
+		pfree(chars);
+		return result;
+	}
+
 	PG_TRY();
 	{
 		utf8 = (char *) pg_do_encoding_conversion(
@@ -651,6 +1047,107 @@ ToString(const char *str, int len, int encoding)
 	return result;
 }
 
+/*
+ * The text of an external string, which is kept in a memory context of its
+ * own until V8 collects the string.  The size is reported to V8, so that
+ * the memory counts for the GC scheduling, while the V8 heap holds only
+ * a small string object.
+ */
+class ExternalText : public String::ExternalAsciiStringResource
+{
+private:
+	MemoryContext	m_cxt;
+	const char	   *m_data;
+	size_t			m_length;
+
+public:
+	ExternalText(MemoryContext cxt, const char *data, size_t length)
+		: m_cxt(cxt), m_data(data), m_length(length)
+	{
+		V8::AdjustAmountOfExternalAllocatedMemory(m_length);
+	}
+	~ExternalText()
+	{
+		V8::AdjustAmountOfExternalAllocatedMemory(-(intptr_t) m_length);
+		MemoryContextDelete(m_cxt);
+	}
+	const char *data() const { return m_data; }
+	size_t length() const { return m_length; }
+};
+
+/*
+ * Convert large text to an external string.  The text is detoasted into
+ * its own memory context, or copied there if it is not toasted, as the
+ * string may outlive the datum.  V8 takes external strings only in ASCII,
+ * so any other text is converted to a regular string.
+ */
+static Local<String>
+ToExternalString(Datum datum)
+{
+	MemoryContext	cxt = NULL;
+	MemoryContext	oldcxt = CurrentMemoryContext;
+	void		   *p;
+
+	PG_TRY();
+	{
+		cxt = AllocSetContextCreate(TopMemoryContext,
+									"PLv8 External String",
+									ALLOCSET_SMALL_MINSIZE,
+									ALLOCSET_SMALL_INITSIZE,
+									ALLOCSET_SMALL_MAXSIZE);
+		MemoryContextSwitchTo(cxt);
+		p = PG_DETOAST_DATUM_PACKED(datum);
+		MemoryContextSwitchTo(oldcxt);
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(oldcxt);
+		if (cxt)
+			MemoryContextDelete(cxt);
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	const char *str = VARDATA_ANY(p);
+	int			len = VARSIZE_ANY_EXHDR(p);
+
+	if (!IsAscii(str, len))
+	{
+		Local<String>	result;
+
+		try
+		{
+			result = ToString(str, len);
+		}
+		catch (...)
+		{
+			MemoryContextDelete(cxt);
+			throw;
+		}
+		MemoryContextDelete(cxt);
+		return result;
+	}
+
+	if (p == DatumGetPointer(datum))
+	{
+		PG_TRY();
+		{
+			char   *copy = (char *) MemoryContextAlloc(cxt, Max(len, 1));
+
+			memcpy(copy, str, len);
+			str = copy;
+		}
+		PG_CATCH();
+		{
+			MemoryContextDelete(cxt);
+			throw pg_error();
+		}
+		PG_END_TRY();
+	}
+
+	return String::NewExternal(new ExternalText(cxt, str, len));
+}
+
 /*
  * Convert utf8 text to database encoded text.
  * The result could be same as utf8 input, or palloc'ed one.
@@ -663,13 +1160,14 @@ ToCString(const String::Utf8Value &value)
 		return NULL;
 
 	int    encoding = GetDatabaseEncoding();
-	if (encoding == PG_UTF8)
+	int    len = value.length();
+	if (encoding == PG_UTF8 || encoding == PG_SQL_ASCII || IsAscii(str, len))
 		return str;
 
 	PG_TRY();
 	{
 		str = (char *) pg_do_encoding_conversion(
-				(unsigned char *) str, strlen(str), PG_UTF8, encoding);
+				(unsigned char *) str, len, PG_UTF8, encoding);
 	}
 	PG_CATCH();
 	{
@@ -695,10 +1193,19 @@ ToCStringCopy(const String::Utf8Value &value)
 	PG_TRY();
 	{
 		int	encoding = GetDatabaseEncoding();
-		str = (char *) pg_do_encoding_conversion(
-				(unsigned char *) utf8, strlen(utf8), PG_UTF8, encoding);
-		if (str == utf8)
-			str = pstrdup(utf8);
+		int	len = value.length();
+
+		if (encoding == PG_UTF8 || encoding == PG_SQL_ASCII ||
+			IsAscii(utf8, len))
+			str = NULL;
+		else
+			str = (char *) pg_do_encoding_conversion(
+					(unsigned char *) utf8, len, PG_UTF8, encoding);
+		if (str == NULL || str == utf8)
+		{
+			str = (char *) palloc(len + 1);
+			memcpy(str, utf8, len + 1);
+		}
 	}
 	PG_CATCH();
 	{
@@ -713,6 +1220,343 @@ ToCStringCopy(const String::Utf8Value &value)
  * Since v8 represents a Date object using a double value in msec from unix epoch,
  * we need to shift the epoch and adjust the time unit.
  */
+#if PG_VERSION_NUM >= 90100
+/*
+ * The on-disk format of numeric, which is private to numeric.c.  The value
+ * is the sum of digits[i] * NBASE^(weight - i), in the short or the long
+ * header format.  The special values have no digits.
+ */
+#define PLV8_NBASE							10000
+#define PLV8_DEC_DIGITS						4
+#define PLV8_NUMERIC_SIGN_MASK				0xC000
+#define PLV8_NUMERIC_POS					0x0000
+#define PLV8_NUMERIC_NEG					0x4000
+#define PLV8_NUMERIC_SHORT					0x8000
+#define PLV8_NUMERIC_SPECIAL				0xC000
+#define PLV8_NUMERIC_EXT_SIGN_MASK			0xF000
+#define PLV8_NUMERIC_PINF					0xD000
+#define PLV8_NUMERIC_NINF					0xF000
+#define PLV8_NUMERIC_DSCALE_MASK			0x3FFF
+#define PLV8_NUMERIC_SHORT_SIGN_MASK		0x2000
+#define PLV8_NUMERIC_SHORT_DSCALE_MASK		0x1F80
+#define PLV8_NUMERIC_SHORT_DSCALE_SHIFT		7
+#define PLV8_NUMERIC_SHORT_WEIGHT_SIGN_MASK	0x0040
+#define PLV8_NUMERIC_SHORT_WEIGHT_MASK		0x003F
+
+typedef struct plv8_numeric
+{
+	int				sign;		/* POS, NEG or the special value */
+	int				weight;
+	int				dscale;
+	int				ndigits;
+	const int16	   *digits;
+} plv8_numeric;
+
+static void
+DecodeNumeric(Numeric num, plv8_numeric *var)
+{
+	const char *data = (const char *) num + VARHDRSZ;
+	int			datalen = VARSIZE(num) - VARHDRSZ;
+	uint16		header = *(const uint16 *) data;
+
+	if ((header & PLV8_NUMERIC_SIGN_MASK) == PLV8_NUMERIC_SPECIAL)
+	{
+		var->sign = header & PLV8_NUMERIC_EXT_SIGN_MASK;
+		var->weight = var->dscale = var->ndigits = 0;
+		var->digits = NULL;
+	}
+	else if (header & PLV8_NUMERIC_SHORT)
+	{
+		var->sign = (header & PLV8_NUMERIC_SHORT_SIGN_MASK) ?
+			PLV8_NUMERIC_NEG : PLV8_NUMERIC_POS;
+		var->weight = (header & PLV8_NUMERIC_SHORT_WEIGHT_MASK);
+		if (header & PLV8_NUMERIC_SHORT_WEIGHT_SIGN_MASK)
+			var->weight |= ~PLV8_NUMERIC_SHORT_WEIGHT_MASK;
+		var->dscale = (header & PLV8_NUMERIC_SHORT_DSCALE_MASK) >>
+			PLV8_NUMERIC_SHORT_DSCALE_SHIFT;
+		var->digits = (const int16 *) (data + sizeof(uint16));
+		var->ndigits = (datalen - sizeof(uint16)) / sizeof(int16);
+	}
+	else
+	{
+		var->sign = header & PLV8_NUMERIC_SIGN_MASK;
+		var->weight = *(const int16 *) (data + sizeof(uint16));
+		var->dscale = header & PLV8_NUMERIC_DSCALE_MASK;
+		var->digits = (const int16 *) (data + sizeof(uint16) + sizeof(int16));
+		var->ndigits = (datalen - sizeof(uint16) - sizeof(int16)) / sizeof(int16);
+	}
+}
+#endif
+
+/*
+ * Convert numeric to double without printing and parsing the text.  When
+ * the digits fit in the 53 bits mantissa and the exponent is within the
+ * exact powers of ten, one multiplication or division gives the correctly
+ * rounded result, which is the same as numeric_float8.  Otherwise, fall
+ * back to numeric_float8.
+ */
+double
+NumericToDouble(Datum datum)
+{
+#if PG_VERSION_NUM >= 90100
+	static const double	pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	const uint64		maxmantissa = UINT64CONST(1) << 53;
+
+	Numeric			num = DatumGetNumeric(datum);
+	plv8_numeric	var;
+	uint64			mantissa = 0;
+	int				exponent;
+	double			result;
+	bool			exact = true;
+
+	DecodeNumeric(num, &var);
+
+	switch (var.sign)
+	{
+	case PLV8_NUMERIC_POS:
+	case PLV8_NUMERIC_NEG:
+		for (int i = 0; i < var.ndigits && exact; i++)
+		{
+			if (mantissa > maxmantissa / PLV8_NBASE)
+				exact = false;
+			else
+				mantissa = mantissa * PLV8_NBASE + var.digits[i];
+		}
+		exponent = PLV8_DEC_DIGITS * (var.weight - (var.ndigits - 1));
+
+		if (exact && mantissa <= maxmantissa &&
+			exponent >= -22 && exponent <= 22)
+		{
+			if (exponent < 0)
+				result = (double) mantissa / pow10[-exponent];
+			else
+				result = (double) mantissa * pow10[exponent];
+			if (var.sign == PLV8_NUMERIC_NEG)
+				result = -result;
+		}
+		else
+			result = DatumGetFloat8(DirectFunctionCall1(numeric_float8,
+											NumericGetDatum(num)));
+		break;
+	case PLV8_NUMERIC_PINF:
+		result = get_float8_infinity();
+		break;
+	case PLV8_NUMERIC_NINF:
+		result = -get_float8_infinity();
+		break;
+	default:
+		result = get_float8_nan();
+		break;
+	}
+
+	if ((Pointer) num != DatumGetPointer(datum))
+		pfree(num);
+
+	return result;
+#else
+	return DatumGetFloat8(DirectFunctionCall1(numeric_float8, datum));
+#endif
+}
+
+/*
+ * Convert numeric to the decimal string as numeric_out does, for
+ * plv8.numeric_as_string.
+ */
+static Local<String>
+NumericToString(Datum datum)
+{
+#if PG_VERSION_NUM >= 90100
+	Numeric			num = DatumGetNumeric(datum);
+	plv8_numeric	var;
+	char		   *str;
+	char		   *cp;
+	int				d;
+
+	DecodeNumeric(num, &var);
+
+	switch (var.sign)
+	{
+	case PLV8_NUMERIC_POS:
+	case PLV8_NUMERIC_NEG:
+		break;
+	case PLV8_NUMERIC_PINF:
+		return String::New("Infinity");
+	case PLV8_NUMERIC_NINF:
+		return String::New("-Infinity");
+	default:
+		return String::New("NaN");
+	}
+
+	cp = str = (char *) palloc(Max(0, var.weight + 1) * PLV8_DEC_DIGITS +
+							   var.dscale + PLV8_DEC_DIGITS + 3);
+
+	if (var.sign == PLV8_NUMERIC_NEG)
+		*cp++ = '-';
+
+	/* The integer part, without leading zeroes in the first digit. */
+	if (var.weight < 0)
+	{
+		d = var.weight + 1;
+		*cp++ = '0';
+	}
+	else
+	{
+		for (d = 0; d <= var.weight; d++)
+		{
+			int		dig = (d < var.ndigits) ? var.digits[d] : 0;
+
+			if (d == 0)
+				cp += sprintf(cp, "%d", dig);
+			else
+				cp += sprintf(cp, "%04d", dig);
+		}
+	}
+
+	/* The fraction part, padded or truncated to dscale. */
+	if (var.dscale > 0)
+	{
+		char   *endcp;
+
+		*cp++ = '.';
+		endcp = cp + var.dscale;
+		for (int i = 0; i < var.dscale; d++, i += PLV8_DEC_DIGITS)
+		{
+			int		dig = (d >= 0 && d < var.ndigits) ? var.digits[d] : 0;
+
+			cp += sprintf(cp, "%04d", dig);
+		}
+		cp = endcp;
+	}
+
+	Local<String>	result = String::New(str, cp - str);
+
+	pfree(str);
+	if ((Pointer) num != DatumGetPointer(datum))
+		pfree(num);
+
+	return result;
+#else
+	plv8_type	type = { 0 };
+
+	type.typid = NUMERICOID;
+	type.fn_output.fn_mcxt = CurrentMemoryContext;
+	return ToString(datum, &type);
+#endif
+}
+
+/*
+ * Convert double to numeric without printing and parsing the text.  The
+ * result is the same as float8_numeric, which rounds the value to DBL_DIG
+ * significant digits: the value is scaled by an exact power of ten to have
+ * DBL_DIG digits in the integer part, rounded correctly with the error of
+ * the scaling given by fma(), and stored in the on-disk format.  Values
+ * out of the range of the exact powers of ten go through float8_numeric.
+ */
+static Datum
+DoubleToNumeric(double value)
+{
+#if PG_VERSION_NUM >= 90100
+	static const double	pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	const uint64		minmantissa = UINT64CONST(100000000000000);
+	const uint64		maxmantissa = UINT64CONST(1000000000000000);
+
+	double		absval = fabs(value);
+	uint64		mantissa = 0;
+	int			exponent;
+	int			scale;
+	int16		digits[6];
+	int			ndigits;
+	int			weight;
+	Numeric		result;
+	uint16	   *data;
+
+	if (value == 0.0)
+		return DirectFunctionCall1(int4_numeric, Int32GetDatum(0));
+	if (!(absval >= 1e-8 && absval < 1e15))
+		return DirectFunctionCall1(float8_numeric, Float8GetDatum(value));
+
+	/* log10() may be off by one around the powers of ten. */
+	exponent = (int) floor(log10(absval));
+	for (;;)
+	{
+		double	product, error, rounded, diff;
+
+		scale = (DBL_DIG - 1) - exponent;
+		if (scale < 0 || scale > 22)
+			return DirectFunctionCall1(float8_numeric, Float8GetDatum(value));
+
+		product = absval * pow10[scale];
+		error = fma(absval, pow10[scale], -product);
+		rounded = nearbyint(product);
+		diff = (product - rounded) + error;
+		if (diff > 0.5 || (diff == 0.5 && fmod(rounded, 2.0) != 0.0))
+			rounded += 1.0;
+		else if (diff < -0.5 || (diff == -0.5 && fmod(rounded, 2.0) != 0.0))
+			rounded -= 1.0;
+		mantissa = (uint64) rounded;
+
+		if (mantissa < minmantissa)
+			exponent--;
+		else if (mantissa > maxmantissa)
+			exponent++;
+		else
+			break;
+	}
+
+	/* The trailing zeroes of the fraction are not in the text, either. */
+	while (scale > 0 && mantissa % 10 == 0)
+	{
+		mantissa /= 10;
+		scale--;
+	}
+
+	/* Align the fraction to the NBASE digits and split the mantissa. */
+	int		dscale = scale;
+
+	while (scale % PLV8_DEC_DIGITS != 0)
+	{
+		mantissa *= 10;
+		scale++;
+	}
+	ndigits = 0;
+	while (mantissa > 0)
+	{
+		digits[ndigits++] = (int16) (mantissa % PLV8_NBASE);
+		mantissa /= PLV8_NBASE;
+	}
+	weight = ndigits - 1 - scale / PLV8_DEC_DIGITS;
+
+	/* Strip the trailing zero digits; the leading digit is not zero. */
+	int		first = 0;
+
+	while (digits[first] == 0)
+		first++;
+
+	result = (Numeric) palloc(VARHDRSZ + sizeof(uint16) +
+							  (ndigits - first) * sizeof(int16));
+	SET_VARSIZE(result, VARHDRSZ + sizeof(uint16) +
+				(ndigits - first) * sizeof(int16));
+	data = (uint16 *) ((char *) result + VARHDRSZ);
+	data[0] = PLV8_NUMERIC_SHORT |
+		(value < 0 ? PLV8_NUMERIC_SHORT_SIGN_MASK : 0) |
+		(dscale << PLV8_NUMERIC_SHORT_DSCALE_SHIFT) |
+		(weight < 0 ? PLV8_NUMERIC_SHORT_WEIGHT_SIGN_MASK : 0) |
+		(weight & PLV8_NUMERIC_SHORT_WEIGHT_MASK);
+	for (int i = ndigits - 1; i >= first; i--)
+		data[ndigits - i] = (uint16) digits[i];
+
+	return NumericGetDatum(result);
+#else
+	return DirectFunctionCall1(float8_numeric, Float8GetDatum(value));
+#endif
+}
+
 static double
 TimestampTzToEpoch(TimestampTz tm)
 {
@@ -9,3 +9,11 @@ $$ LANGUAGE plv8;
 
 SELECT conv('{"i": 3, "b": 20}');
 SELECT conv('[1, 2, 3]');
+CREATE FUNCTION json_roundtrip(o json) RETURNS json AS $$
+return o;
+$$ LANGUAGE plv8;
+SELECT json_roundtrip('{"a": [1, -0.5, 1e3, null, true, false], "s": "q\"\\\t\u0041", "o": {}}');
+CREATE FUNCTION json_special() RETURNS json AS $$
+return { d: new Date(0), u: undefined, f: function() {}, n: NaN, a: [undefined, "x"] };
+$$ LANGUAGE plv8;
+SELECT json_special();
@@ -0,0 +1,33 @@
+CREATE FUNCTION jsonb_conv(o jsonb) RETURNS jsonb AS $$
+if (o instanceof Array) {
+	o[1] = 10;
+} else if (typeof(o) == 'object' && o !== null) {
+	o.i = 10;
+}
+return o;
+$$ LANGUAGE plv8;
+
+SELECT jsonb_conv('{"i": 3, "b": {"c": [true, null, "x"]}}');
+SELECT jsonb_conv('[1, 2.5, 3]');
+SELECT jsonb_conv('5');
+
+CREATE FUNCTION jsonb_type(o jsonb) RETURNS text AS $$
+return typeof o;
+$$ LANGUAGE plv8;
+SELECT jsonb_type('{}'), jsonb_type('[]'), jsonb_type('1.5'), jsonb_type('"s"');
+
+CREATE FUNCTION jsonb_special() RETURNS jsonb AS $$
+return { d: new Date(0), u: undefined, f: function() {}, n: NaN, a: [undefined, "x"] };
+$$ LANGUAGE plv8;
+SELECT jsonb_special();
+
+CREATE FUNCTION jsonb_nul(key boolean) RETURNS jsonb AS $$
+return key ? { "a\u0000b": 1 } : { a: "x\u0000y" };
+$$ LANGUAGE plv8;
+SELECT jsonb_nul(false);
+SELECT jsonb_nul(true);
+
+CREATE FUNCTION jsonb_digits() RETURNS jsonb AS $$
+return { big: 9007199254740991, sum: 0.1 + 0.2, tiny: 1.5e-7 };
+$$ LANGUAGE plv8;
+SELECT jsonb_digits();
@@ -57,6 +57,12 @@ CREATE FUNCTION int4array_to_textarray(x int4[]) RETURNS text[] AS $$ return x;
 SELECT int4array_to_textarray(ARRAY[123, 456]::int4[]);
 CREATE FUNCTION textarray_to_int4array(x text[]) RETURNS int4[] AS $$ return x; $$ LANGUAGE plv8;
 SELECT textarray_to_int4array(ARRAY['123', '456']::text[]);
+CREATE FUNCTION int4array_to_json(x int4[]) RETURNS text AS $$ return JSON.stringify(x); $$ LANGUAGE plv8;
+SELECT int4array_to_json(ARRAY[[1, 2, 3], [4, 5, 6]]);
+SELECT int4array_to_json(ARRAY[1, NULL, 3]);
+SELECT int4array_to_textarray(ARRAY[[123, 456], [789, 0]]::int4[]);
+CREATE FUNCTION ragged_array() RETURNS int4[] AS $$ return [[1, 2], [3]]; $$ LANGUAGE plv8;
+SELECT ragged_array(); -- error
 
 CREATE FUNCTION timestamptz_to_text(t timestamptz) RETURNS text AS $$ return t.toUTCString() $$ LANGUAGE plv8;
 SELECT timestamptz_to_text('23 Dec 2010 12:34:56 GMT');
@@ -193,6 +199,39 @@ $$
 LANGUAGE plv8 IMMUTABLE STRICT;
 SELECT fastsum(ARRAY[1, 2, 3, 4, 5]);
 SELECT fastsum(ARRAY[NULL, 2]);
+CREATE FUNCTION typed_dims(ary plv8_int4array) RETURNS text AS
+$$
+    return JSON.stringify(ary.dims) + ' ' + ary.length;
+$$
+LANGUAGE plv8 IMMUTABLE STRICT;
+SELECT typed_dims(ARRAY[[1, 2, 3], [4, 5, 6]]);
+CREATE FUNCTION half(x float8) RETURNS float8 AS
+$$
+    return x / 2;
+$$
+LANGUAGE plv8 IMMUTABLE STRICT;
+SELECT plv8_map('half(float8)', ARRAY[1, NULL, 5]::float8[]);
+CREATE FUNCTION bytea_pass(b bytea) RETURNS bytea AS
+$$
+    return b;
+$$
+LANGUAGE plv8 IMMUTABLE STRICT;
+SELECT bytea_pass('\x00ff10'::bytea), bytea_pass(decode(repeat('ab', 3000), 'hex')) = decode(repeat('ab', 3000), 'hex');
+CREATE FUNCTION bytea_inc(b bytea) RETURNS bytea AS
+$$
+    b[0]++;
+    return b;
+$$
+LANGUAGE plv8 IMMUTABLE STRICT;
+SELECT bytea_inc(b), b FROM (VALUES ('\x01ff'::bytea)) v(b);
+CREATE FUNCTION text_len(t text) RETURNS text AS
+$$
+    return t.length + ':' + t.toUpperCase();
+$$
+LANGUAGE plv8 IMMUTABLE STRICT;
+SET plv8.external_string_threshold = 0;
+SELECT text_len('abc'), text_len(repeat('x', 5000)) = '5000:' || repeat('X', 5000);
+RESET plv8.external_string_threshold;
 
 -- elog()
 CREATE FUNCTION test_elog(arg text) RETURNS void AS
@@ -462,3 +501,159 @@ $$ LANGUAGE plv8 IMMUTABLE;
 SELECT plv8_quotes('select');
 SELECT plv8_quotes('kevin''s name');
 SELECT plv8_quotes(NULL);
+
+-- lazy rows
+CREATE FUNCTION test_lazy_rows() RETURNS text AS $$
+  var rows = plv8.execute("SELECT i, 's' || i AS s FROM generate_series(1, 3) AS t(i)", {lazy: true});
+  rows[1].s = 'changed';
+  var plan = plv8.prepare("SELECT 1 AS a, 'x'::text AS b");
+  var cursor = plan.cursor({lazy: true});
+  var row = cursor.fetch();
+  cursor.close();
+  plan.free();
+  return rows.map(function(r){ return r.i + ':' + r.s }).join(',') + ' ' +
+    JSON.stringify(rows[0]) + ' ' + row.a + row.b;
+$$ LANGUAGE plv8;
+SELECT test_lazy_rows();
+
+-- columnar result
+CREATE FUNCTION test_columnar() RETURNS text AS $$
+  var cols = plv8.execute("SELECT i, i * 0.5::float8 AS f, 'v' || i AS t, nullif(i, 2) AS n FROM generate_series(1, 3) AS t(i)", {columnar: true});
+  return [cols.i.length, cols.i[2], cols.f[1], cols.t.join(''), cols.n[1] === null,
+    Array.isArray(cols.i), Array.isArray(cols.n)].join(',');
+$$ LANGUAGE plv8;
+SELECT test_columnar();
+
+-- SRF returning an iterator
+CREATE FUNCTION set_of_iterator(n int) RETURNS SETOF rec AS
+$$
+	var i = 0;
+	return {
+		next: function() {
+			if (i >= n)
+				return { done: true };
+			i++;
+			var t = plv8.execute( "SELECT chr(96 + $1) AS t", [ i ] )[0].t;
+			return { done: false, value: { i: i, t: t } };
+		}
+	};
+$$
+LANGUAGE plv8;
+SELECT * FROM set_of_iterator(3);
+
+-- SRF iterator stops at LIMIT
+CREATE FUNCTION set_of_iterator_error() RETURNS SETOF int AS
+$$
+	var i = 0;
+	return {
+		next: function() {
+			if (++i > 2)
+				throw new Error( "too many" );
+			return { done: false, value: i };
+		}
+	};
+$$
+LANGUAGE plv8;
+SELECT set_of_iterator_error() LIMIT 2;
+
+-- code cache
+SET plv8.code_cache = on;
+CREATE FUNCTION code_cache_test() RETURNS text AS
+$$
+	var stats = plv8.code_cache_stats();
+	return stats.hits + ':' + stats.misses;
+$$
+LANGUAGE plv8;
+SELECT code_cache_test();
+CREATE FUNCTION code_cache_purge() RETURNS boolean AS
+$$
+	return plv8.code_cache_purge() > 0;
+$$
+LANGUAGE plv8;
+SELECT code_cache_purge();
+RESET plv8.code_cache;
+
+-- cached trigger converter follows ALTER TABLE
+ALTER TABLE trig_table ADD COLUMN note text;
+INSERT INTO trig_table VALUES ('modify', 5, 'x');
+SELECT * FROM trig_table;
+
+-- numeric
+CREATE FUNCTION numeric_conv(n numeric) RETURNS text AS
+$$
+	return typeof n + ':' + n;
+$$
+LANGUAGE plv8;
+SELECT numeric_conv(123.45), numeric_conv(-0.000120), numeric_conv(100);
+SET plv8.numeric_as_string = on;
+SELECT numeric_conv(123.45), numeric_conv(-0.000120), numeric_conv(100);
+RESET plv8.numeric_as_string;
+CREATE FUNCTION numeric_ret(i int) RETURNS numeric AS
+$$
+	return [0.1 + 0.2, 1 / 3, -1.5e-5, 2.5e20, 123456.789][i];
+$$
+LANGUAGE plv8;
+SELECT i, numeric_ret(i) FROM generate_series(0, 4) i;
+
+-- plan cache of execute()
+CREATE TABLE plan_tbl (a int);
+INSERT INTO plan_tbl VALUES (1), (2);
+CREATE FUNCTION plan_cache_test(n int) RETURNS text AS
+$$
+	var sum = 0;
+	for (var i = 0; i < n; i++)
+		sum += plv8.execute("SELECT count(*)::int AS c FROM plan_tbl WHERE a > $1", [i])[0].c;
+	return sum + ':' + JSON.stringify(plv8.execute("SELECT * FROM plan_tbl WHERE a = $1", [1]));
+$$
+LANGUAGE plv8;
+SELECT plan_cache_test(3);
+ALTER TABLE plan_tbl ADD COLUMN b text DEFAULT 'x';
+SELECT plan_cache_test(3);
+SET plv8.plan_cache_size = 1;
+SELECT plan_cache_test(3);
+CREATE FUNCTION plan_inner(n int) RETURNS int AS
+$$
+	return plv8.execute("SELECT $1::int + 1 AS v", [n])[0].v;
+$$
+LANGUAGE plv8;
+CREATE FUNCTION plan_outer() RETURNS int AS
+$$
+	return plv8.execute("SELECT plan_inner($1) AS v", [1])[0].v;
+$$
+LANGUAGE plv8;
+SELECT plan_outer(), plan_outer();
+RESET plv8.plan_cache_size;
+
+-- executeMany()
+CREATE TABLE bulk_tbl (i int, s text);
+CREATE FUNCTION bulk_test() RETURNS text AS
+$$
+	var plan = plv8.prepare("INSERT INTO bulk_tbl VALUES ($1, $2)", ["int", "text"]);
+	var n = plan.executeMany([[1, "a"], [2, null], [3, "c"]]);
+	try {
+		plan.executeMany([[4, "d"], [5]]);
+	} catch (e) {
+		plv8.elog(INFO, e);
+	}
+	plan.free();
+	return n;
+$$
+LANGUAGE plv8;
+SELECT bulk_test();
+SELECT * FROM bulk_tbl;
+
+-- column names shared with Object.prototype
+CREATE TYPE proto_rec AS ("toString" text, "constructor" int);
+CREATE FUNCTION proto_names() RETURNS proto_rec AS
+$$
+	return { toString: 'a', constructor: 1 };
+$$
+LANGUAGE plv8;
+SELECT * FROM proto_names();
+CREATE FUNCTION proto_column() RETURNS text AS
+$$
+	var row = plv8.execute('SELECT 1 AS "__proto__", 2 AS a')[0];
+	return typeof row.hasOwnProperty + ':' + row.a;
+$$
+LANGUAGE plv8;
+SELECT proto_column();
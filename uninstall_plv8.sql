@@ -1,5 +1,7 @@
 SET search_path = public;
 
+DROP FUNCTION plv8_map(regprocedure, anyarray);
+DROP FUNCTION plv8_map_internal(regprocedure, anyarray, regtype);
 DROP LANGUAGE plv8;
 DROP FUNCTION plv8_call_handler();
 DROP FUNCTION plv8_inline_handler(internal);